@@ -3,96 +3,113 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include "globals.h"
+#include "parser.h"
+#include "resolve.h"
 #include "asgn2_helper_funcs.h"
 
-/** @brief Creates a Response struct for a GET Request
- * 
- * @param content_length integer representing content length
- * 
- * @return pointer to a new Response struct
-*/
-Response *create_get_response(long long content_length) {
-    Response *resp = calloc(1, sizeof(Response));
-    resp->status_line = strdup("200 OK\r\n");
-    resp->content_length = content_length;
+// The status line, headers and message body of a response whose body is its reason phrase.
+// body_len has to be the length of reason plus its newline; test_responses checks it.
+#define RESPONSE(code, reason, body_len)                                                           \
+    {                                                                                              \
+        code,                                                                                      \
+            "HTTP/1.1 " #code " " reason "\r\nContent-Length: " #body_len "\r\n\r\n" reason "\n",  \
+            sizeof("HTTP/1.1 " #code " " reason "\r\nContent-Length: " #body_len "\r\n\r\n" reason \
+                   "\n")                                                                           \
+                - 1                                                                                \
+    }
 
-    return resp;
-}
+static const Response responses[] = {
+    RESPONSE(200, "OK", 3),
+    RESPONSE(201, "Created", 8),
+    RESPONSE(400, "Bad Request", 12),
+    RESPONSE(403, "Forbidden", 10),
+    RESPONSE(404, "Not Found", 10),
+    RESPONSE(500, "Internal Server Error", 22),
+    RESPONSE(501, "Not Implemented", 16),
+    RESPONSE(505, "Version Not Supported", 22),
+};
+#define NUM_RESPONSES (sizeof(responses) / sizeof(responses[0]))
 
-/** @brief Creates a Response struct
+// Everything in a GET response before its Content-Length value
+#define GET_RESPONSE_HEAD "HTTP/1.1 200 OK\r\nContent-Length: "
+
+/** @brief Looks up the preformatted response for a status code
  * 
  * @param status_code integer representing a status code
  * 
- * @return pointer to a new Response struct
+ * @return pointer to a static Response; 505 for any code without one
 */
-Response *create_response(int status_code) {
-    Response *resp = calloc(1, sizeof(Response));
-    switch (status_code) {
-    case 200:
-        resp->status_line = strdup("200 OK\r\n");
-        resp->msg = strdup("OK\n");
-        break;
-    case 201:
-        resp->status_line = strdup("201 Created\r\n");
-        resp->msg = strdup("Created\n");
-        break;
-    case 400:
-        resp->status_line = strdup("400 Bad Request\r\n");
-        resp->msg = strdup("Bad Request\n");
-        break;
-    case 403:
-        resp->status_line = strdup("403 Forbidden\r\n");
-        resp->msg = strdup("Forbidden\n");
-        break;
-    case 404:
-        resp->status_line = strdup("404 Not Found\r\n");
-        resp->msg = strdup("Not Found\n");
-        break;
-    case 500:
-        resp->status_line = strdup("500 Internal Server Error\r\n");
-        resp->msg = strdup("Internal Server Error\n");
-        break;
-    case 501:
-        resp->status_line = strdup("501 Not Implemented\r\n");
-        resp->msg = strdup("Not Implemented\n");
-        break;
-    default:
-        resp->status_line = strdup("505 Version Not Supported\r\n");
-        resp->msg = strdup("Version Not Supported\n");
+const Response *get_response(int status_code) {
+    for (size_t i = 0; i < NUM_RESPONSES; i++) {
+        if (responses[i].status_code == status_code)
+            return &responses[i];
     }
-    resp->content_length = strlen(resp->msg);
-    return resp;
+    return &responses[NUM_RESPONSES - 1];
 }
 
 /**
- * @brief Given a pointer to a Response struct, it frees it
- * and sets the pointer to NULL
+ * @brief Writes a complete response, with its message body, to a file desciptor/socket in a
+ * single write
+ * 
+ * @param status_code integer representing a status code
  * 
- * @param resp Pointer to Response struct
+ * @param outfd File descriptor/socket to output to
 */
-void delete_response(Response *resp) {
-    free(resp->status_line);
-    if (resp->msg)
-        free(resp->msg);
-    free(resp);
-    resp = NULL;
+void write_response(int status_code, int outfd) {
+    const Response *resp = get_response(status_code);
+    write_all(outfd, (char *) resp->text, resp->len);
 }
 
 /**
- * @brief Writes a Response to a file desciptor/socket
+ * @brief Writes the status line and headers of a GET response. The file's contents follow
+ * through pass_bytes, so on a socket the head is sent with MSG_MORE and goes out in the same
+ * segment as the start of the body instead of a segment of its own.
  * 
- * @param resp Pointer to Response struct
+ * @param content_length number of bytes in the message body
  * 
  * @param outfd File descriptor/socket to output to
 */
-void write_response(Response *resp, int outfd) {
-    dprintf(
-        outfd, "HTTP/1.1 %sContent-Length: %lld\r\n\r\n", resp->status_line, resp->content_length);
-    if (resp->msg)
-        dprintf(outfd, "%s", resp->msg);
+void write_get_response(long long content_length, int outfd) {
+    char head[sizeof(GET_RESPONSE_HEAD) + 24];
+    memcpy(head, GET_RESPONSE_HEAD, sizeof(GET_RESPONSE_HEAD) - 1);
+    size_t len = sizeof(GET_RESPONSE_HEAD) - 1;
+    len += snprintf(head + len, sizeof(head) - len, "%lld\r\n\r\n", content_length);
+
+    int flags = content_length > 0 ? MSG_MORE : 0;
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(outfd, head + sent, len - sent, flags);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            // Not a socket
+            if (errno == ENOTSOCK)
+                write_all(outfd, head + sent, len - sent);
+            return;
+        }
+        sent += n;
+    }
+}
+
+///@brief Unit tests for the preformatted responses
+void test_responses() {
+    for (size_t i = 0; i < NUM_RESPONSES; i++) {
+        const Response *resp = &responses[i];
+        assert(resp == get_response(resp->status_code));
+        assert(resp->len == strlen(resp->text));
+        // Content-Length has to match the body after the blank line
+        const char *body = strstr(resp->text, "\r\n\r\n") + 4;
+        const char *cl = strstr(resp->text, "Content-Length: ") + strlen("Content-Length: ");
+        assert(strtol(cl, NULL, 10) == (long) strlen(body));
+    }
+    assert(get_response(418)->status_code == 505);
+    fprintf(stderr, "PASSED %zu/%zu for responses\n", NUM_RESPONSES + 1, NUM_RESPONSES + 1);
 }
 
 /**
@@ -108,16 +125,22 @@ void write_response(Response *resp, int outfd) {
  * 
  * @param resource URI to resource
  * 
+ * @param fd the resource, opened by validate_resource
+ * 
+ * @param st stat of the resource
+ * 
  * @return pointer to a new Request struct
 */
-Request *create_request(
-    COMMAND cmd, FILE_STATUS fs, long long content_length, int in_fd, char *resource) {
+Request *create_request(COMMAND cmd, FILE_STATUS fs, long long content_length, int in_fd,
+    char *resource, int fd, const struct stat *st) {
     Request *req = calloc(1, sizeof(Request));
     req->cmd = cmd;
     req->fs = fs;
     req->content_length = content_length;
     req->in_fd = in_fd;
     req->resource = strdup(resource);
+    req->fd = fd;
+    req->st = *st;
     return req;
 }
 
@@ -136,30 +159,19 @@ void delete_request(Request *req) {
 /// @brief Handles a GET request
 /// @param req ptr to Request struct
 void handle_get(Request *req) {
-    int fd = open(req->resource, O_RDONLY);
-    if (fd < 0) {
-        Response *resp = create_response(500);
-        write_response(resp, req->in_fd);
-        perror("File descriptor in handle_get() was invalid: ");
-
-        // Cleanup
-        delete_request(req);
-        delete_response(resp);
-        return;
-    }
-    // Get file size
-    struct stat st;
-    fstat(fd, &st);
-    size_t file_size = st.st_size;
-    // Create response
-    Response *resp = create_get_response(file_size);
-    write_response(resp, req->in_fd);
+    int fd = req->fd;
+    // A shared lock keeps PUTs in other prefork workers from changing it mid-send
+    flock(fd, LOCK_SH);
+    // Get file size; a PUT in another worker may have changed it since it was resolved
+    fstat(fd, &req->st);
+    size_t file_size = req->st.st_size;
+    // Send the head; the body follows it
+    write_get_response(file_size, req->in_fd);
     // Pass bytes from resource to socket
     pass_bytes(fd, req->in_fd, file_size);
 
     // Cleanup
-    close(fd);
-    delete_response(resp);
+    resolve_close(fd);
     delete_request(req);
 }
 
@@ -167,20 +179,11 @@ void handle_get(Request *req) {
 /// @param req ptr to Request struct
 void handle_put(Request *req, char *extra, long extra_size) {
     // Handle PUT Request
-    int fd = open(req->resource, O_TRUNC | O_WRONLY);
-    if (fd < 0) {
-        Response *resp = create_response(500);
-        write_response(resp, req->in_fd);
-        perror("File descriptor in handle_put() was invalid: ");
-
-        // Cleanup
-        delete_request(req);
-        delete_response(resp);
-        return;
-    }
-    Response *resp = create_response(200 + req->fs);
-    write_response(resp, req->in_fd);
-    delete_response(resp);
+    int fd = req->fd;
+    // Truncate only once no other prefork worker is reading or writing it
+    flock(fd, LOCK_EX);
+    ftruncate(fd, 0);
+    write_response(200 + req->fs, req->in_fd);
     long long ret = 0;
     // If extra exists
     if (extra_size > 0) {
@@ -188,10 +191,8 @@ void handle_put(Request *req, char *extra, long extra_size) {
     }
     // Error checking
     if (ret < 0) {
-        Response *r = create_response(500);
-        write_response(r, req->in_fd);
-        close(fd);
-        delete_response(r);
+        write_response(500, req->in_fd);
+        resolve_close(fd);
         delete_request(req);
         perror("Failed to write to file: ");
         return;
@@ -199,15 +200,13 @@ void handle_put(Request *req, char *extra, long extra_size) {
     ret = pass_bytes(req->in_fd, fd, req->content_length - extra_size);
     // Error checking
     if (ret < 0) {
-        Response *r = create_response(500);
-        write_response(r, req->in_fd);
-        close(fd);
-        delete_response(r);
+        write_response(500, req->in_fd);
+        resolve_close(fd);
         delete_request(req);
         perror("Failed to write to file: ");
         return;
     }
-    close(fd);
+    resolve_close(fd);
     // Cleanup
     delete_request(req);
 }
@@ -224,3 +223,37 @@ void handle_request(Request *req, char *extra, long extra_size) {
         handle_put(req, extra, extra_size);
     }
 }
+
+/** @brief Empties out anything the client still sends after an invalid request, so that closing
+ * the socket doesn't reset the connection before the error response reaches it
+*/
+static void drain(int sock) {
+    char dummy[BUFSIZE];
+    while (read_until(sock, dummy, BUFSIZE, NULL) > 0)
+        ;
+}
+
+/// @brief Reads, parses and handles the request on a connection
+/// @param sock connected socket, left open for the caller to close
+void handle_connection(int sock) {
+    // Buffer to store request line + header fields, and possibly the start of the body
+    char buf[BUFSIZE];
+
+    // Read in and parse the request header; anything malformed or too long is a 400
+    Parser parser;
+    long long nbytes = read_request(sock, buf, BUFSIZE - 1, &parser);
+    if (nbytes == -1) {
+        write_response(400, sock);
+        drain(sock);
+        return;
+    }
+    // Any message body that got read along with the header follows it in buf
+    char *msg_content = buf + parser.head_len;
+    long long extra_msg_size = nbytes - parser.head_len;
+    Request *req = parse_request_header(buf, &parser, sock);
+    if (!req) {
+        drain(sock);
+        return;
+    }
+    handle_request(req, msg_content, extra_msg_size);
+}
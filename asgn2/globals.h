@@ -3,6 +3,9 @@
 #define BUFSIZE       3072
 #define REQUEST_LIMIT 2048
 
+#include <stddef.h>
+#include <sys/stat.h>
+
 // ENUMS
 typedef enum { GET, PUT } COMMAND;
 typedef enum { OK, CREATED } FILE_STATUS;
@@ -14,22 +17,27 @@ typedef struct {
     char *resource;
     long long content_length;
     int in_fd;
+    // The resource, opened by validate_resource, and its stat at the time
+    int fd;
+    struct stat st;
 } Request;
 
+// A complete response with a fixed message body, preformatted so it goes out in one write
 typedef struct {
-    char *status_line;
-    char *msg;
-    long long content_length;
+    int status_code;
+    const char *text;
+    size_t len;
 } Response;
 
 // Response Helper Funcs
-Response *create_get_response(long long content_length);
-Response *create_response(int status_code);
-void delete_response(Response *resp);
-void write_response(Response *resp, int outfd);
+const Response *get_response(int status_code);
+void write_response(int status_code, int outfd);
+void write_get_response(long long content_length, int outfd);
+void test_responses();
 
 // Request Helper Funcs
-Request *create_request(
-    COMMAND cmd, FILE_STATUS fs, long long content_length, int in_fd, char *resource);
+Request *create_request(COMMAND cmd, FILE_STATUS fs, long long content_length, int in_fd,
+    char *resource, int fd, const struct stat *st);
 void handle_request(Request *req, char *extra, long extra_size);
+void handle_connection(int sock);
 void delete_request(Request *req);
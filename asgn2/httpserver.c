@@ -1,30 +1,136 @@
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
 #include <limits.h>
+#include <time.h>
 
 #include "asgn2_helper_funcs.h"
 #include "parser.h"
 #include "globals.h"
+#include "resolve.h"
+
+/** @brief Accepts and serves connections on listener, one at a time, forever
+ *
+ * @param listener bound listening socket
+*/
+static void serve(Listener_Socket *listener) {
+    // Each worker remembers its own lookups
+    resolve_init();
+    // Listen for connections forever
+    while (1) {
+        int sock = listener_accept(listener);
+        if (sock == -1) {
+            fprintf(stderr, "Couldn't connect to a socket\n");
+            continue;
+        }
+        handle_connection(sock);
+        close(sock);
+    }
+}
+
+/** @brief Forks a worker that serves connections on listener
+ *
+ * @return the worker's pid, or -1 if fork failed
+*/
+static pid_t spawn_worker(Listener_Socket *listener) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Don't outlive the supervisor
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1)
+            _exit(EXIT_FAILURE);
+        serve(listener);
+        _exit(EXIT_SUCCESS);
+    }
+    if (pid < 0)
+        perror("Failed to fork worker: ");
+    return pid;
+}
+
+/** @brief Runs worker processes that all accept on the same listener, and restarts any that
+ * exit. The kernel hands each connection to exactly one of the workers blocked in accept.
+ *
+ * @param listener bound listening socket, shared by every worker
+ *
+ * @param workers number of worker processes
+*/
+static void prefork(Listener_Socket *listener, int workers) {
+    pid_t *pids = calloc(workers, sizeof(pid_t));
+    time_t *started = calloc(workers, sizeof(time_t));
+    for (int i = 0; i < workers; i++) {
+        pids[i] = spawn_worker(listener);
+        started[i] = time(NULL);
+    }
+
+    while (1) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            // No children left, e.g. every fork failed; try again shortly
+            sleep(1);
+            for (int i = 0; i < workers; i++) {
+                if (pids[i] < 0) {
+                    pids[i] = spawn_worker(listener);
+                    started[i] = time(NULL);
+                }
+            }
+            continue;
+        }
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] != pid)
+                continue;
+            if (WIFSIGNALED(status))
+                fprintf(
+                    stderr, "Worker %d killed by signal %d, restarting\n", pid, WTERMSIG(status));
+            else
+                fprintf(stderr, "Worker %d exited with %d, restarting\n", pid, WEXITSTATUS(status));
+            // A worker that dies right away would otherwise be restarted in a tight loop
+            if (time(NULL) - started[i] < 1)
+                sleep(1);
+            pids[i] = spawn_worker(listener);
+            started[i] = time(NULL);
+        }
+    }
+}
 
 int main(int argc, char **argv) {
 
     // Parse command line arguments
-    if (argc != 2) {
-        fprintf(stderr, "Usage: ./httpserver <port>\n");
+    int opt;
+    long workers = 0;
+    char *end = NULL;
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        switch (opt) {
+        case 'p':
+            workers = strtol(optarg, &end, 10);
+            if (*end != '\0' || workers < 1 || workers > 1024) {
+                fprintf(stderr, "Invalid number of workers\n");
+                return 1;
+            }
+            break;
+        default: fprintf(stderr, "Usage: ./httpserver [-p workers] <port>\n"); return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: ./httpserver [-p workers] <port>\n");
         return 1;
     }
-    int port = strtol(argv[1], NULL, 10);
+    int port = strtol(argv[optind], NULL, 10);
     if (port < 1 || port > 65535) {
         fprintf(stderr, "Invalid Port\n");
         return 1;
     }
 
-    // Bind socket to port
+    // Bind socket to port, once; prefork workers inherit it
     Listener_Socket listener;
     int ret = listener_init(&listener, port);
     if (ret) {
@@ -32,58 +138,11 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    // Listen for connections forever
-    while (1) {
-        int sock = listener_accept(&listener);
-        if (sock == -1) {
-            fprintf(stderr, "Couldn't connect to a socket\n");
-            continue;
-        }
-        // Buffer to store request line + header fields
-        char buf[BUFSIZE];
-        memset(buf, 0, BUFSIZE);
-
-        // Buffer to store any part of message body that got sucked into 'buf'
-        char msg_content[BUFSIZE];
-        memset(msg_content, 0, BUFSIZE);
-
-        // Read in request header and extra data if it exists
-        long long nbytes = read_request(sock, buf, BUFSIZE - 1);
-        if (nbytes == -1) {
-            Response *resp = create_response(400);
-            write_response(resp, sock);
-            delete_response(resp);
-            close(sock);
-            continue;
-        }
-        // Find where the message starts
-        char *msg_start = strstr(buf, "\r\n\r\n");
-        long long request_size = (msg_start - buf) + 4;
-        long long extra_msg_size = nbytes - request_size;
-        // Check request size
-        if (request_size > REQUEST_LIMIT) {
-            Response *resp = create_response(400);
-            write_response(resp, sock);
-            delete_response(resp);
-            close(sock);
-            continue;
-        }
-        // Copy extra message contents to msg_content if they exist
-        if (extra_msg_size) {
-            memcpy(msg_content, msg_start + 4, extra_msg_size);
-            msg_content[extra_msg_size] = 0; // NULL Terminate
-            *(msg_start + 4) = 0;
-        }
-        Request *req = parse_request_header(buf, sock);
-        if (!req) {
-            // Empty out anything after an invalid request
-            char dummy[BUFSIZE];
-            while (read_until(sock, dummy, BUFSIZE, NULL) > 0)
-                ;
-            close(sock);
-            continue;
-        }
-        handle_request(req, msg_content, extra_msg_size);
-        close(sock);
-    }
+    // A client hanging up early should fail that write, not kill the process serving it
+    signal(SIGPIPE, SIG_IGN);
+    if (workers)
+        prefork(&listener, workers);
+    else
+        serve(&listener);
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,339 @@
+// Microbenchmarks for the request path: parsing, Content-Length validation, reading a request
+// off a socket, and whole requests served over socketpairs, with no network involved. Reports
+// ns/op, allocations/op and ops/s for realistic and adversarial requests, and compares the
+// parser with the regex it replaced.
+//
+// usage: microbench [-t seconds_per_case]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "asgn2_helper_funcs.h"
+#include "globals.h"
+#include "parser.h"
+#include "resolve.h"
+
+#define USAGE "usage: %s [-t seconds_per_case]\n"
+
+// Size of the file the GET samples fetch
+#define BENCH_FILE_SIZE 4096
+
+// glibc's allocator under its internal names, which the counting wrappers below forward to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *malloc(size_t size) {
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+typedef struct {
+    const char *name;
+    // Head, and the body a PUT sends after it
+    char head[REQUEST_LIMIT + 64];
+    const char *body;
+    // Status the server answers with
+    int expected;
+} Sample;
+
+#define NUM_SAMPLES 10
+static Sample samples[NUM_SAMPLES];
+static double seconds_per_case = 0.2;
+static int devnull;
+
+/** @brief Fills in a sample
+ *
+ * @param s sample to fill in
+ *
+ * @param name sample name for the report
+ *
+ * @param head request line and header fields, without the blank line ending them
+ *
+ * @param body message body for a PUT, or NULL
+ *
+ * @param expected status the server answers with
+*/
+static void sample(Sample *s, const char *name, const char *head, const char *body, int expected) {
+    s->name = name;
+    snprintf(s->head, sizeof(s->head), "%s\r\n", head);
+    s->body = body ? body : "";
+    s->expected = expected;
+}
+
+/** @brief Pads a sample's head with header fields until it is exactly len bytes, counting the
+ * blank line that ends it
+*/
+static void pad_head(Sample *s, size_t len) {
+    size_t used = strlen(s->head) - 2;
+    size_t pad = len - 2 - used;
+    // "X-Pad-NN: ", 1 to 128 value bytes and "\r\n" make a field of 13 to 140 bytes
+    size_t fields = (pad + 139) / 140;
+    for (size_t i = 0; i < fields; i++) {
+        size_t value_len = pad / fields + (i < pad % fields) - 12;
+        used += sprintf(s->head + used, "X-Pad-%02zu: ", i % 100);
+        memset(s->head + used, 'v', value_len);
+        used += value_len;
+        used += sprintf(s->head + used, "\r\n");
+    }
+    strcpy(s->head + used, "\r\n");
+    assert(strlen(s->head) == len);
+}
+
+/// @brief Builds the request corpus
+static void make_samples() {
+    const char *curl = "Host: localhost:8080\r\nUser-Agent: curl/7.81.0\r\nAccept: */*\r\n";
+    char head[512];
+    Sample *s = samples;
+
+    // Realistic
+    snprintf(head, sizeof(head), "GET /bench.txt HTTP/1.1\r\n%s", curl);
+    sample(s++, "get", head, NULL, 200);
+    snprintf(head, sizeof(head), "PUT /put.txt HTTP/1.1\r\n%sContent-Length: 12\r\n", curl);
+    sample(s++, "put", head, "hello world\n", 200);
+    snprintf(head, sizeof(head), "GET /missing.txt HTTP/1.1\r\n%s", curl);
+    sample(s++, "get-404", head, NULL, 404);
+
+    // Adversarial: heads right at and just past REQUEST_LIMIT
+    sample(s, "headers-2048", "GET /bench.txt HTTP/1.1\r\n", NULL, 200);
+    pad_head(s++, REQUEST_LIMIT);
+    sample(s, "headers-2049", "GET /bench.txt HTTP/1.1\r\n", NULL, 400);
+    pad_head(s++, REQUEST_LIMIT + 1);
+    // Many short header fields
+    sample(s, "many-headers", "GET /bench.txt HTTP/1.1\r\n", NULL, 200);
+    for (int i = 0; i < 100; i++)
+        sprintf(s->head + strlen(s->head) - 2, "K%02d: v\r\n\r\n", i);
+    s++;
+    sample(s++, "bad-version", "GET /bench.txt HTTP/1.2\r\n", NULL, 505);
+    sample(s++, "bad-method", "DELETE /bench.txt HTTP/1.1\r\n", NULL, 501);
+    sample(s++, "bad-length", "PUT /put.txt HTTP/1.1\r\nContent-Length: 12a\r\n", NULL, 400);
+    sample(s++, "long-uri",
+        "GET /abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghij HTTP/1.1\r\n", NULL,
+        404);
+    assert(s == samples + NUM_SAMPLES);
+}
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** @brief Silences the server's own diagnostics on stderr, or brings them back
+*/
+static void quiet(int on) {
+    static int saved_stderr = -1;
+    if (on) {
+        saved_stderr = dup(STDERR_FILENO);
+        dup2(devnull, STDERR_FILENO);
+    } else {
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+    }
+}
+
+// Runs body repeatedly for seconds_per_case, quietly, then reports it
+#define BENCH(group, name, body)                                                                   \
+    do {                                                                                           \
+        quiet(1);                                                                                  \
+        unsigned long ops = 0, start_allocs = allocs;                                              \
+        double start = now_s(), elapsed;                                                           \
+        do {                                                                                       \
+            for (int batch = 0; batch < 64; batch++, ops++) {                                      \
+                body;                                                                              \
+            }                                                                                      \
+        } while ((elapsed = now_s() - start) < seconds_per_case);                                  \
+        quiet(0);                                                                                  \
+        printf("%-8s %-14s %10lu %10.0f %10.2f %12.0f\n", group, name, ops, elapsed * 1e9 / ops,   \
+            (double) (allocs - start_allocs) / ops, ops / elapsed);                                \
+    } while (0)
+
+/** @brief Parses a head the way read_request and parse_request_header would once it's read,
+ * and releases whatever that produced
+*/
+static void parse_once(const Sample *s, size_t len) {
+    char buf[BUFSIZE];
+    memcpy(buf, s->head, len + 1);
+    Parser p;
+    parser_init(&p);
+    if (parser_feed(&p, buf, len) != PARSE_DONE || p.head_len > REQUEST_LIMIT)
+        return;
+    Request *req = parse_request_header(buf, &p, devnull);
+    if (req) {
+        resolve_close(req->fd);
+        delete_request(req);
+    }
+}
+
+/** @brief Matches a head against PARSE_REGEX the way requests were parsed before the state
+ * machine: compiling the regex for every request
+*/
+static void regcomp_once(const char *head) {
+    regex_t re;
+    regmatch_t matches[5];
+    if (regcomp(&re, PARSE_REGEX, REG_EXTENDED))
+        return;
+    regexec(&re, head, 5, matches, 0);
+    regfree(&re);
+}
+
+/// @brief Runs the state machine alone over a head
+static void feed_once(const Sample *s, size_t len) {
+    Parser p;
+    parser_init(&p);
+    parser_feed(&p, s->head, len);
+}
+
+/** @brief Sends a head down one end of a socketpair and reads it off the other
+*/
+static void read_once(const Sample *s, size_t len, int *sv) {
+    char buf[BUFSIZE];
+    Parser p;
+    write_all(sv[0], (char *) s->head, len);
+    read_request(sv[1], buf, BUFSIZE - 1, &p);
+}
+
+/** @brief Serves one whole request over a fresh socketpair, the way serve does for an accepted
+ * connection
+ *
+ * @return the status the server answered with
+*/
+static int serve_once(const Sample *s, size_t len) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+        return 0;
+    write_all(sv[0], (char *) s->head, len);
+    write_all(sv[0], (char *) s->body, strlen(s->body));
+    shutdown(sv[0], SHUT_WR);
+    handle_connection(sv[1]);
+    close(sv[1]);
+
+    // Every response fits in the socket buffer, so reading it afterwards can't deadlock
+    char buf[BENCH_FILE_SIZE + 256];
+    size_t got = 0;
+    ssize_t n;
+    while ((n = read(sv[0], buf + got, sizeof(buf) - 1 - got)) > 0)
+        got += n;
+    close(sv[0]);
+    buf[got] = '\0';
+    int status = 0;
+    sscanf(buf, "HTTP/1.1 %d", &status);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    char *end = NULL;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't':
+            seconds_per_case = strtod(optarg, &end);
+            if (*end != '\0' || seconds_per_case <= 0) {
+                fprintf(stderr, "Invalid number of seconds\n");
+                return 1;
+            }
+            break;
+        default: fprintf(stderr, USAGE, argv[0]); return 1;
+        }
+    }
+
+    // Serve out of a scratch directory
+    char dir[] = "/tmp/asgn2-bench-XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir)) {
+        perror("Failed to create a scratch directory: ");
+        return EXIT_FAILURE;
+    }
+    devnull = open("/dev/null", O_WRONLY);
+    char contents[BENCH_FILE_SIZE];
+    memset(contents, 'b', sizeof(contents));
+    int fd = open("bench.txt", O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    write_all(fd, contents, sizeof(contents));
+    close(fd);
+    fd = open("put.txt", O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    close(fd);
+    resolve_init();
+    make_samples();
+
+    printf("%-8s %-14s %10s %10s %10s %12s\n", "bench", "request", "ops", "ns/op", "allocs/op",
+        "ops/s");
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+        const Sample *s = &samples[i];
+        size_t len = strlen(s->head);
+        BENCH("parse", s->name, parse_once(s, len));
+    }
+
+    // The regex the parser replaced, compiled per request and compiled once, against the state
+    // machine alone, on the realistic PUT
+    const Sample *put = &samples[1];
+    size_t put_len = strlen(put->head);
+    BENCH("regcomp", put->name, regcomp_once(put->head));
+    regex_t re;
+    regmatch_t matches[5];
+    if (regcomp(&re, PARSE_REGEX, REG_EXTENDED)) {
+        fprintf(stderr, "regcomp failed\n");
+        return EXIT_FAILURE;
+    }
+    BENCH("regexec", put->name, regexec(&re, put->head, 5, matches, 0));
+    regfree(&re);
+    BENCH("feed", put->name, feed_once(put, put_len));
+
+    char content_lengths[][40] = { "Content-Length: 12", "Content-Length: 9223372036854775807",
+        "Content-Length: 99999999999999999999", "Content-Length: 12a" };
+    const char *cl_names[] = { "cl-short", "cl-max", "cl-overflow", "cl-invalid" };
+    for (int i = 0; i < 4; i++) {
+        char *cl = content_lengths[i];
+        BENCH("cl", cl_names[i], validate_content_length(cl));
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        perror("socketpair failed: ");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+        const Sample *s = &samples[i];
+        size_t len = strlen(s->head);
+        BENCH("read", s->name, read_once(s, len, sv));
+    }
+    close(sv[0]);
+    close(sv[1]);
+
+    int mismatches = 0;
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+        const Sample *s = &samples[i];
+        size_t len = strlen(s->head);
+        quiet(1);
+        int status = serve_once(s, len);
+        quiet(0);
+        if (status != s->expected) {
+            fprintf(stderr, "%s: expected %d, got %d\n", s->name, s->expected, status);
+            mismatches++;
+        }
+        BENCH("serve", s->name, serve_once(s, len));
+    }
+
+    unlink("bench.txt");
+    unlink("put.txt");
+    rmdir(dir);
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -10,6 +10,7 @@
 #include "asgn2_helper_funcs.h"
 #include "globals.h"
 #include "parser.h"
+#include "resolve.h"
 
 /// @brief Runs all unit tests
 void run_tests() {
@@ -17,87 +18,212 @@ void run_tests() {
     test_validate_resource();
     test_validate_version();
     test_validate_content_length();
+    test_parser_feed();
+    test_responses();
+    test_resolve();
 }
 
-/** @brief Returns a buffer containing the HTTP Request's request line and header fields terminated by double \r\n and potentially some of Message Content
+/** @brief Resets a Parser to the start of a request
+ *
+ * @param p Parser to reset
+*/
+void parser_init(Parser *p) {
+    memset(p, 0, sizeof(Parser));
+    p->state = PARSE_METHOD;
+}
+
+/// @brief Characters allowed in a URI after its leading '/'
+static int is_uri_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.'
+           || c == '_';
+}
+
+/// @brief Characters allowed in a header field name
+static int is_key_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.'
+           || c == '-';
+}
+
+/** @brief Advances the parser over buf[p->pos..end), the bytes that arrived since the last call.
+ * Accepts exactly the language of PARSE_REGEX, one byte at a time, and stops at the end of the
+ * header fields; anything after them is message body and is left alone.
+ *
+ * @param p Parser, initialized with parser_init
+ *
+ * @param buf buffer holding the whole request so far
+ *
+ * @param end number of valid bytes in buf
+ *
+ * @return PARSE_DONE once the final \r\n\r\n has been seen, PARSE_ERROR as soon as the request
+ * can't match, otherwise the state to continue from when more bytes arrive
+*/
+PARSE_STATE parser_feed(Parser *p, const char *buf, size_t end) {
+    static const char version[] = "HTTP/#.#";
+
+    for (; p->pos < end && p->state < PARSE_DONE; p->pos++) {
+        char c = buf[p->pos];
+        switch (p->state) {
+        case PARSE_METHOD:
+            if (c >= 'A' && c <= 'Z' && p->len < 8) {
+                p->len++;
+            } else if (c == ' ' && p->len >= 3) {
+                p->method_len = p->len;
+                p->state = PARSE_URI_START;
+            } else {
+                p->state = PARSE_ERROR;
+            }
+            break;
+        case PARSE_URI_START:
+            p->uri_off = p->pos;
+            p->len = 0;
+            p->state = c == '/' ? PARSE_URI : PARSE_ERROR;
+            break;
+        case PARSE_URI:
+            if (is_uri_char(c) && p->len < 63) {
+                p->len++;
+            } else if (c == ' ' && p->len >= 1) {
+                p->uri_len = p->len + 1;
+                p->version_off = p->pos + 1;
+                p->len = 0;
+                p->state = PARSE_VERSION;
+            } else {
+                p->state = PARSE_ERROR;
+            }
+            break;
+        case PARSE_VERSION:
+            // '#' in the template stands for any digit
+            if (p->len == sizeof(version) - 1) {
+                p->state = c == '\r' ? PARSE_REQUEST_LF : PARSE_ERROR;
+            } else if (version[p->len] == '#' ? c >= '0' && c <= '9' : c == version[p->len]) {
+                p->len++;
+            } else {
+                p->state = PARSE_ERROR;
+            }
+            break;
+        case PARSE_REQUEST_LF:
+        case PARSE_HEADER_LF: p->state = c == '\n' ? PARSE_HEADER_START : PARSE_ERROR; break;
+        case PARSE_HEADER_START:
+            if (c == '\r') {
+                p->state = PARSE_END_LF;
+            } else if (is_key_char(c)) {
+                p->key_off = p->pos;
+                p->len = 1;
+                p->state = PARSE_KEY;
+            } else {
+                p->state = PARSE_ERROR;
+            }
+            break;
+        case PARSE_KEY:
+            if (is_key_char(c) && p->len < 128) {
+                p->len++;
+            } else if (c == ':') {
+                p->state = PARSE_KEY_SP;
+            } else {
+                p->state = PARSE_ERROR;
+            }
+            break;
+        case PARSE_KEY_SP:
+            p->len = 0;
+            p->state = c == ' ' ? PARSE_VALUE : PARSE_ERROR;
+            break;
+        case PARSE_VALUE:
+            if (c >= ' ' && c <= '~' && p->len < 128) {
+                p->len++;
+            } else if (c == '\r' && p->len >= 1) {
+                // Only the first Content-Length counts
+                if (!p->has_content_length && p->pos - p->key_off - p->len == 16
+                    && !strncmp(buf + p->key_off, "Content-Length", 14)) {
+                    p->has_content_length = 1;
+                    p->cl_off = p->key_off;
+                    p->cl_end = p->pos;
+                }
+                p->state = PARSE_HEADER_LF;
+            } else {
+                p->state = PARSE_ERROR;
+            }
+            break;
+        case PARSE_END_LF:
+            if (c == '\n') {
+                p->head_len = p->pos + 1;
+                p->state = PARSE_DONE;
+            } else {
+                p->state = PARSE_ERROR;
+            }
+            break;
+        default: break;
+        }
+    }
+    return p->state;
+}
+
+/** @brief Reads the HTTP Request's request line and header fields into buf, parsing them as they
+ * arrive. buf may also end up holding the start of the message body.
  * 
- * @param fd socker from which to read the HTTP Request from
+ * @param fd socket from which to read the HTTP Request from
  * 
  * @param buf buffer to read into, will be null-terminated at the end
  * 
- * @param bufsize size of buffer
+ * @param bufsize size of buffer, not counting room for the terminating null
+ *
+ * @param p Parser, set to PARSE_DONE with head_len filled in on success
  * 
  * @return number of bytes read or -1 if timeout or Bad Request
 */
-long long read_request(int fd, char *buf, size_t bufsize) {
-    // Read from socket
-    int nbytes = read_until(fd, buf, bufsize, "\r\n\r\n");
-    if (nbytes < 1)
-        return nbytes;
-
-    // Check if request terminates with double \r\n
-    if (!strstr(buf, "\r\n\r\n"))
-        return -1;
+long long read_request(int fd, char *buf, size_t bufsize, Parser *p) {
+    parser_init(p);
+    size_t nbytes = 0;
+    while (nbytes < bufsize) {
+        ssize_t n = read(fd, buf + nbytes, bufsize - nbytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        nbytes += n;
 
-    buf[nbytes] = 0;
-    return nbytes;
+        // Malformed or oversized requests are rejected without waiting for the rest
+        PARSE_STATE state = parser_feed(p, buf, nbytes);
+        if (state == PARSE_ERROR || (state != PARSE_DONE && p->pos > REQUEST_LIMIT))
+            return -1;
+        if (state == PARSE_DONE) {
+            if (p->head_len > REQUEST_LIMIT)
+                return -1;
+            buf[nbytes] = 0;
+            return nbytes;
+        }
+    }
+    return -1;
 }
 
-/** @brief given a buffer containing '\r\n\r\n', parse request line and header fields using regex
+/** @brief Validates a request that read_request parsed, by splitting its tokens in place
  * 
- * @param buf buffer to parse
+ * @param buf buffer the request was read into
+ *
+ * @param p Parser in the PARSE_DONE state
  * 
- * @param msg_content buffer containing first couple bytes of message body
+ * @param fd socket to send errors to
  * 
  * @return pointer to Request struct
 */
-Request *parse_request_header(char *buf, int fd) {
-    // Copy request line and header fields
-    regex_t re;
-    regmatch_t matches[5];
-    int rc;
-
-    // Compile regex
-    rc = regcomp(&re, PARSE_REGEX, REG_EXTENDED);
-    if (rc)
-        return NULL;
-
-    // Execute regex on buffer
-    rc = regexec(&re, buf, 5, matches, 0);
-    char *cmd, *uri, *version, *content_length;
-    if (rc == 0) {
-        cmd = buf;
-        uri = buf + matches[2].rm_so;
-        version = buf + matches[3].rm_so;
-        content_length = strstr(buf + matches[0].rm_so, "Content-Length");
-
-        // Get all the matches, then validate them
-        cmd[matches[1].rm_eo] = '\0';
-        uri[matches[2].rm_eo - matches[2].rm_so] = '\0';
-        version[matches[3].rm_eo - matches[3].rm_so] = '\0';
-
-        // Get content length header if it exists
-        if (content_length) {
-            content_length[strcspn(content_length, "\r\n")] = '\0';
-        }
-    } else {
-        regfree(&re);
-        Response *resp = create_response(400);
-        write_response(resp, fd);
-        delete_response(resp);
-        fprintf(stderr, "Bad Request, doesn't match regex\n");
-        return NULL;
+Request *parse_request_header(char *buf, Parser *p, int fd) {
+    // Terminate each token where its delimiter was
+    char *cmd = buf;
+    cmd[p->method_len] = '\0';
+    char *uri = buf + p->uri_off;
+    uri[p->uri_len] = '\0';
+    char *version = buf + p->version_off;
+    version[8] = '\0';
+    char *content_length = NULL;
+    if (p->has_content_length) {
+        content_length = buf + p->cl_off;
+        buf[p->cl_end] = '\0';
     }
-    regfree(&re);
 
     // Creates request if everything was valid
     int ret;
     COMMAND method;
     FILE_STATUS fs;
     if ((ret = validate_method(cmd)) < 0) {
-        Response *resp = create_response(501);
-        write_response(resp, fd);
-        delete_response(resp);
+        write_response(501, fd);
         fprintf(stderr, "Method Not Implemented\n");
         return NULL;
     }
@@ -105,48 +231,111 @@ Request *parse_request_header(char *buf, int fd) {
 
     // Validate version
     if (validate_version(version)) {
-        Response *resp = create_response(505);
-        write_response(resp, fd);
-        delete_response(resp);
+        write_response(505, fd);
         fprintf(stderr, "Version Not Supported\n");
         return NULL;
     }
 
-    // Validate and process resource if version and method are valid
-    char resource[512] = ".";
-    strcat(resource, uri);
-    if ((ret = validate_resource(cmd, resource)) < 0) {
-        Response *resp;
+    // Validate and process resource if version and method are valid; the URI without its
+    // leading '/' is the path relative to the working directory
+    char *resource = uri + 1;
+    int resource_fd;
+    struct stat st;
+    if ((ret = validate_resource(cmd, resource, &resource_fd, &st)) < 0) {
         if (ret == -1) {
-            resp = create_response(404);
+            write_response(404, fd);
             fprintf(stderr, "Not Found\n");
         } else {
-            resp = create_response(403);
+            write_response(403, fd);
             fprintf(stderr, "Unauthorized, invalid permissions or file, %s, is a dir\n", resource);
         }
-        write_response(resp, fd);
-        delete_response(resp);
         return NULL;
     }
     fs = ret;
 
     ssize_t cl = 0;
     if (content_length && (cl = validate_content_length(content_length)) < 0) {
-        Response *resp = create_response(400);
-        write_response(resp, fd);
-        delete_response(resp);
+        write_response(400, fd);
+        resolve_close(resource_fd);
         fprintf(stderr, "Bad Request, invalid content length\n");
         return NULL;
     }
     // PUT must have a content_length and message body
     if (method == PUT && !content_length) {
-        Response *resp = create_response(400);
-        write_response(resp, fd);
+        write_response(400, fd);
+        resolve_close(resource_fd);
         fprintf(stderr, "Bad Request, invalid use of 'Content-Length' header\n");
-        delete_response(resp);
         return NULL;
     }
-    return create_request(method, fs, cl, fd, resource);
+    return create_request(method, fs, cl, fd, resource, resource_fd, &st);
+}
+
+// Requests the state machine is checked against, and the regex's verdict on each
+static const char *sample_requests[] = {
+    "GET /foo.txt HTTP/1.1\r\n\r\n",
+    "PUT /a HTTP/1.1\r\nContent-Length: 5\r\n\r\n",
+    "GET /foo HTTP/2.0\r\nHost: localhost:8080\r\nAccept: */*\r\n\r\n",
+    "DELETE /foo HTTP/1.1\r\n\r\n",
+    "GET /foo HTTP/1.1\r\nKey:  x\r\n\r\n",
+    "GET /abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijk HTTP/1.1\r\n\r\n",
+    "GE /foo HTTP/1.1\r\n\r\n",
+    "GETTINGSS /foo HTTP/1.1\r\n\r\n",
+    "get /foo HTTP/1.1\r\n\r\n",
+    "GET foo HTTP/1.1\r\n\r\n",
+    "GET / HTTP/1.1\r\n\r\n",
+    "GET  /foo HTTP/1.1\r\n\r\n",
+    "GET /a-b HTTP/1.1\r\n\r\n",
+    "GET /abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijkl HTTP/1.1\r\n\r\n",
+    "GET /foo HTTP/1.10\r\n\r\n",
+    "GET /foo HTTP/1.1\n\n",
+    "GET /foo HTTP/1.1\r\nKey:value\r\n\r\n",
+    "GET /foo HTTP/1.1\r\nKey: \r\n\r\n",
+    "GET /foo HTTP/1.1\r\nKey: a\tb\r\n\r\n",
+    "GET /foo HTTP/1.1\r\nKe y: ab\r\n\r\n",
+    "GET /foo HTTP/1.1\r\nA: b\r\n",
+    "GET /foo HTTP/1.1\r\n\r\nX",
+};
+static const int sample_valid[] = { 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0 };
+
+/** @brief Runs a whole request through a fresh Parser, n bytes at a time
+ *
+ * @return 1 if the parser accepted it as a complete request and nothing more
+*/
+static int parse_all(const char *req, size_t n) {
+    Parser p;
+    parser_init(&p);
+    size_t len = strlen(req);
+    for (size_t end = n; end < len + n; end += n)
+        parser_feed(&p, req, end < len ? end : len);
+    return p.state == PARSE_DONE && p.head_len == len;
+}
+
+/// @brief Unit tests parser_feed against PARSE_REGEX, whole and a byte at a time
+void test_parser_feed() {
+    regex_t re;
+    assert(0 == regcomp(&re, PARSE_REGEX, REG_EXTENDED));
+    size_t n = sizeof(sample_requests) / sizeof(sample_requests[0]);
+    for (size_t i = 0; i < n; i++) {
+        int regex_valid = 0 == regexec(&re, sample_requests[i], 0, NULL, 0);
+        assert(regex_valid == sample_valid[i]);
+        assert(regex_valid == parse_all(sample_requests[i], strlen(sample_requests[i])));
+        assert(regex_valid == parse_all(sample_requests[i], 1));
+    }
+    regfree(&re);
+
+    // Tokens are found where the regex puts them
+    Parser p;
+    const char *req = "PUT /a.txt HTTP/1.1\r\nX-Len: 1\r\nContent-Length: 42\r\n\r\nbody";
+    parser_init(&p);
+    assert(PARSE_DONE == parser_feed(&p, req, strlen(req)));
+    assert(3 == p.method_len);
+    assert(4 == p.uri_off && 6 == p.uri_len);
+    assert(!strncmp(req + p.version_off, "HTTP/1.1", 8));
+    assert(p.has_content_length && !strncmp(req + p.cl_off, "Content-Length: 42\r", 19));
+    assert(p.cl_end == p.cl_off + 18);
+    assert(strlen(req) - 4 == p.head_len);
+    fprintf(stderr, "PASSED %zu/%zu for parser_feed()\n", n + 1, n + 1);
 }
 
 // VALIDATION HELPER FUNCS
@@ -185,67 +374,88 @@ void test_validate_method() {
 }
 
 /**
- * @brief Validates the resource of a Request
+ * @brief Validates the resource of a Request, and opens it for the handler: for reading if
+ * method is GET, for writing if it is PUT
  * 
  * @param method that contains the HTTP Method (validated)
  *
  * @param resource that contains the URI to the resource
  * 
+ * @param fd set to the opened resource, to release with resolve_close, or -1 if it's invalid
+ * 
+ * @param st set to the stat of the opened resource
+ * 
  * @return an int, 0 if exists, 1 if it got created, -1 if doesn't exist, -2 if wrong perms/isdir
 */
-int validate_resource(char *method, char *resource) {
-    int fd;
-    struct stat st;
-    stat(resource, &st);
+int validate_resource(char *method, char *resource, int *fd, struct stat *st) {
     errno = 0;
 
     if (!strcmp(method, "PUT")) {
-        fd = open(resource, O_TRUNC | O_WRONLY);
-        if (fd < 0) {
-            // If it cannot be accessed/isdir return -2
-            if (errno == EACCES || errno == EISDIR)
-                return -2;
-            fd = open(resource, O_CREAT | O_RDWR, 0666);
-            close(fd);
-            return 1;
+        // Only check that it's writable; handle_put truncates it once it holds the lock
+        *fd = resolve_open(resource, O_WRONLY, st);
+        if (*fd >= 0)
+            return 0;
+        // If it cannot be accessed/isdir return -2
+        if (errno == EACCES || errno == EISDIR)
+            return -2;
+        // O_EXCL: when prefork workers race to create it, exactly one of them gets 201
+        *fd = open(resource, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0666);
+        if (*fd < 0 && errno == EEXIST) {
+            *fd = resolve_open(resource, O_WRONLY, st);
+            return *fd < 0 ? -2 : 0;
+        }
+        if (*fd < 0 || fstat(*fd, st)) {
+            resolve_close(*fd);
+            *fd = -1;
+            return -2;
         }
-    } else {
-        fd = open(resource, O_RDONLY, 0);
+        // This process may remember it as missing
+        resolve_invalidate(resource);
+        return 1;
     }
 
+    *fd = resolve_open(resource, O_RDONLY, st);
     // Error checking
-    if (fd < 0 && errno == ENOENT)
+    if (*fd < 0 && errno == ENOENT)
         return -1;
     // Invalid perms but file exists
-    if (fd < 0 && errno == EACCES)
+    if (*fd < 0)
         return -2;
     // File is a dir
-    if (fd > 0 && S_ISDIR(st.st_mode)) {
-        close(fd);
+    if (S_ISDIR(st->st_mode)) {
+        resolve_close(*fd);
+        *fd = -1;
         return -2;
     }
-
-    close(fd);
     return 0;
 }
 
+/// @brief Validates a resource and releases it again
+static int check_resource(char *method, char *resource) {
+    int fd;
+    struct stat st;
+    int ret = validate_resource(method, resource, &fd, &st);
+    resolve_close(fd);
+    return ret;
+}
+
 ///@brief Unit tests validate resource
 // TODO: update these
 void test_validate_resource() {
     // Invalid GET's
-    assert(-1 == validate_resource("GET", "./invalid.txt"));
+    assert(-1 == check_resource("GET", "./invalid.txt"));
     mkdir("invalid_dir", 0777);
-    assert(-2 == validate_resource("GET", "./invalid_dir"));
+    assert(-2 == check_resource("GET", "./invalid_dir"));
     rmdir("invalid_dir");
     int fd = open("locked.txt", O_CREAT | O_WRONLY | O_TRUNC, 0222);
     close(fd);
-    assert(-2 == validate_resource("GET", "./locked.txt"));
+    assert(-2 == check_resource("GET", "./locked.txt"));
     remove("locked.txt");
     // Valid calls
-    assert(0 == validate_resource("GET", "./foo.txt"));
-    assert(1 == validate_resource("PUT", "./new.txt"));
-    assert(0 == validate_resource("PUT", "./new.txt"));
-    assert(0 == validate_resource("GET", "./new.txt"));
+    assert(0 == check_resource("GET", "./foo.txt"));
+    assert(1 == check_resource("PUT", "./new.txt"));
+    assert(0 == check_resource("PUT", "./new.txt"));
+    assert(0 == check_resource("GET", "./new.txt"));
     remove("./new.txt");
     fprintf(stderr, "PASSED 6/6 for validate_resource()\n");
 }
@@ -283,21 +493,20 @@ void test_validate_version() {
 */
 long long validate_content_length(char *content_length) {
     long long val;
-    char temp[BUFSIZE];
     char *end_ptr;
     errno = 0;
     // Get ptr to ': ' and increment it by 2 to get to first digit of content length
-    char *start = strstr(content_length, ": ") + 2;
+    char *start = strstr(content_length, ": ");
     // Shouldn't happen
     if (!start)
         return -1;
-    strcpy(temp, start);
-    val = strtoll(temp, &end_ptr, 10);
+    start += 2;
+    val = strtoll(start, &end_ptr, 10);
 
     // Error checking
     if (errno != 0)
         return -1;
-    if (end_ptr == temp)
+    if (end_ptr == start)
         return -1;
     if (*end_ptr != '\0')
         return -1;
@@ -1,21 +1,63 @@
 #pragma once
 #include "globals.h"
 
+#include <stddef.h>
+#include <sys/stat.h>
+
 // PARSE_REGEX matches for request headers of the following form
 // HTTPMETHOD /URI HTTP/1.1\r\nOptional-Header-Fields: asdsad\r\nContent-Length: 123123\r\nMoreOptional-HeaderFields\r\n\r\n
 // Invalid Method = Not Implemented
 // Invalid Version = Version Not Supported
 // Anything else invalid = Bad Request
+// The Parser below accepts exactly this grammar; the regex itself is only used by the tests.
 #define PARSE_REGEX                                                                                \
     "^([A-Z]{3,8}) (/[a-zA-Z0-9._]{1,63}) (HTTP/[0-9][.][0-9])\r\n([a-zA-Z0-9.-]{1,128}: [ "       \
     "-~]{1,128}\r\n)*\r\n$"
 
+// Where the Parser is in the request line and header fields
+typedef enum {
+    PARSE_METHOD,
+    PARSE_URI_START,
+    PARSE_URI,
+    PARSE_VERSION,
+    PARSE_REQUEST_LF,
+    PARSE_HEADER_START,
+    PARSE_KEY,
+    PARSE_KEY_SP,
+    PARSE_VALUE,
+    PARSE_HEADER_LF,
+    PARSE_END_LF,
+    PARSE_DONE,
+    PARSE_ERROR
+} PARSE_STATE;
+
+// Incremental request parser. Tokens are recorded as offsets into the buffer being parsed,
+// so nothing is copied.
+typedef struct {
+    PARSE_STATE state;
+    // Offset of the next byte to look at, and the length of the token being read
+    size_t pos;
+    size_t len;
+    size_t method_len;
+    size_t uri_off, uri_len;
+    size_t version_off;
+    size_t key_off;
+    // The first Content-Length header field: offset of its line and of the '\r' ending it
+    int has_content_length;
+    size_t cl_off, cl_end;
+    // Length of the request line and header fields, including the final \r\n\r\n
+    size_t head_len;
+} Parser;
+
 void run_tests();
-long long read_request(int fd, char *buf1, size_t buf1size);
-Request *parse_request_header(char *buf, int fd);
+void parser_init(Parser *p);
+PARSE_STATE parser_feed(Parser *p, const char *buf, size_t end);
+long long read_request(int fd, char *buf, size_t bufsize, Parser *p);
+Request *parse_request_header(char *buf, Parser *p, int fd);
+void test_parser_feed();
 int validate_method(char *buf);
 void test_validate_method();
-int validate_resource(char *method, char *resource);
+int validate_resource(char *method, char *resource, int *fd, struct stat *st);
 void test_validate_resource();
 int validate_version(char *version);
 void test_validate_version();
@@ -0,0 +1,216 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "resolve.h"
+
+// A recent lookup of a resource for reading: an open fd for a regular file that exists, or
+// -1 for one that didn't (ENOENT)
+typedef struct {
+    char name[64];
+    int fd;
+} Resolution;
+
+static Resolution cache[RESOLVE_CACHE_SIZE];
+static int cache_used[RESOLVE_CACHE_SIZE];
+// Watches the serving directory; -1 while caching is off
+static int inotify_fd = -1;
+
+/** @brief Strips the "./" a resource may start with, so that it matches the names inotify
+ * reports
+*/
+static const char *cache_key(const char *resource) {
+    return strncmp(resource, "./", 2) ? resource : resource + 2;
+}
+
+/// @brief Slot a resource's lookup is remembered in
+static size_t cache_slot(const char *key) {
+    size_t h = 5381;
+    for (; *key; key++)
+        h = h * 33 + (unsigned char) *key;
+    return h % RESOLVE_CACHE_SIZE;
+}
+
+/// @brief Forgets whatever slot i remembers
+static void cache_evict(size_t i) {
+    if (cache_used[i] && cache[i].fd >= 0)
+        close(cache[i].fd);
+    cache_used[i] = 0;
+}
+
+/// @brief Forgets every lookup
+static void cache_clear() {
+    for (size_t i = 0; i < RESOLVE_CACHE_SIZE; i++)
+        cache_evict(i);
+}
+
+/** @brief Drops the lookups of every file that was created, deleted, renamed or had its
+ * permissions changed since the last call, by this process or any other
+*/
+static void cache_sync() {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(inotify_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + n;) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW)
+                cache_clear();
+            else if (ev->len)
+                resolve_invalidate(ev->name);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+/** @brief Turns on the lookup cache for the working directory. Without it every lookup goes to
+ * the file system. Call it in each process that serves requests, since the cache and its
+ * inotify watch belong to the process.
+*/
+void resolve_init() {
+    cache_clear();
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("Resource cache disabled, inotify_init1 failed: ");
+        return;
+    }
+    // Changes to a file's contents don't matter: a cached fd reads them like a fresh one would
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB;
+    if (inotify_add_watch(inotify_fd, ".", mask) < 0) {
+        perror("Resource cache disabled, inotify_add_watch failed: ");
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+}
+
+/**
+ * @brief Opens a resource and stats it, in one path lookup at most. Lookups for reading
+ * (O_RDONLY) are cached: a regular file found recently is served from the fd already open for
+ * it, and a file found missing recently is reported missing again without asking the file
+ * system.
+ *
+ * @param resource path to the resource
+ *
+ * @param flags open flags
+ *
+ * @param st filled in with the resource's stat if it was opened
+ *
+ * @return an fd to release with resolve_close, or -1 with errno set
+*/
+int resolve_open(const char *resource, int flags, struct stat *st) {
+    const char *key = cache_key(resource);
+    size_t i = cache_slot(key);
+    int cacheable = inotify_fd >= 0 && flags == O_RDONLY && strlen(key) < sizeof(cache[i].name)
+                    && !strchr(key, '/');
+    if (cacheable) {
+        cache_sync();
+        if (cache_used[i] && !strcmp(cache[i].name, key)) {
+            if (cache[i].fd < 0) {
+                errno = ENOENT;
+                return -1;
+            }
+            // The last GET read it to the end
+            if (lseek(cache[i].fd, 0, SEEK_SET) == 0 && !fstat(cache[i].fd, st))
+                return cache[i].fd;
+            cache_evict(i);
+        }
+    }
+
+    int fd = open(resource, flags | O_CLOEXEC);
+    if (fd < 0) {
+        if (cacheable && errno == ENOENT) {
+            cache_evict(i);
+            strcpy(cache[i].name, key);
+            cache[i].fd = -1;
+            cache_used[i] = 1;
+            errno = ENOENT;
+        }
+        return -1;
+    }
+    if (fstat(fd, st)) {
+        close(fd);
+        return -1;
+    }
+    if (cacheable && S_ISREG(st->st_mode)) {
+        cache_evict(i);
+        strcpy(cache[i].name, key);
+        cache[i].fd = fd;
+        cache_used[i] = 1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Releases an fd from resolve_open. A cached one stays open for the next lookup, but
+ * gives up any flock it holds.
+ *
+ * @param fd fd to release
+*/
+void resolve_close(int fd) {
+    if (fd < 0)
+        return;
+    for (size_t i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+        if (cache_used[i] && cache[i].fd == fd) {
+            flock(fd, LOCK_UN);
+            return;
+        }
+    }
+    close(fd);
+}
+
+/**
+ * @brief Forgets the lookup of a resource, e.g. after a PUT created it
+ *
+ * @param resource path to the resource
+*/
+void resolve_invalidate(const char *resource) {
+    const char *key = cache_key(resource);
+    size_t i = cache_slot(key);
+    if (cache_used[i] && !strcmp(cache[i].name, key))
+        cache_evict(i);
+}
+
+///@brief Unit tests for the resource cache
+void test_resolve() {
+    resolve_init();
+    struct stat st;
+    remove("resolve.txt");
+
+    // A miss is remembered until the file shows up
+    assert(-1 == resolve_open("resolve.txt", O_RDONLY, &st) && errno == ENOENT);
+    assert(-1 == resolve_open("./resolve.txt", O_RDONLY, &st) && errno == ENOENT);
+    int fd = open("resolve.txt", O_CREAT | O_WRONLY, 0666);
+    assert(2 == write(fd, "hi", 2));
+    close(fd);
+
+    // A hit hands out the same fd, rewound, with a fresh stat
+    fd = resolve_open("resolve.txt", O_RDONLY, &st);
+    assert(fd >= 0 && st.st_size == 2);
+    char c;
+    assert(1 == read(fd, &c, 1));
+    resolve_close(fd);
+    assert(fd == resolve_open("./resolve.txt", O_RDONLY, &st) && st.st_size == 2);
+    assert(1 == read(fd, &c, 1) && c == 'h');
+    resolve_close(fd);
+
+    // Removing it is noticed without a lookup
+    remove("resolve.txt");
+    assert(-1 == resolve_open("resolve.txt", O_RDONLY, &st) && errno == ENOENT);
+
+    // Directories and other flags aren't cached
+    mkdir("resolve_dir", 0777);
+    fd = resolve_open("resolve_dir", O_RDONLY, &st);
+    assert(fd >= 0 && S_ISDIR(st.st_mode));
+    resolve_close(fd);
+    assert(-1 == fcntl(fd, F_GETFD));
+    rmdir("resolve_dir");
+    fprintf(stderr, "PASSED 9/9 for resolve()\n");
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <sys/stat.h>
+
+// Number of recent lookups remembered, both found and not found
+#define RESOLVE_CACHE_SIZE 64
+
+// Resource Resolution Funcs
+void resolve_init();
+int resolve_open(const char *resource, int flags, struct stat *st);
+void resolve_close(int fd);
+void resolve_invalidate(const char *resource);
+void test_resolve();
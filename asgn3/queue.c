@@ -123,3 +123,77 @@ bool queue_pop(queue_t *q, void **elem) {
     sem_post(q->empty_spaces);
     return true;
 }
+
+/** @brief push several elements onto a queue, in order.
+ *
+ *  @param q the queue to push the elements into.
+ *
+ *  @param elems the elements to add to the queue, first one first.
+ *
+ *  @param n the number of elements in elems.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless the q parameter is NULL.
+ */
+bool queue_push_many(queue_t *q, void **elems, size_t n) {
+    if (!q)
+        return false;
+    size_t pushed = 0;
+    while (pushed < n) {
+        // Wait until the queue is NOT full, then take whatever other
+        // spaces are free without waiting for more
+        sem_wait(q->empty_spaces);
+        size_t batch = 1;
+        while (pushed + batch < n && !sem_trywait(q->empty_spaces))
+            batch++;
+        // One trip through the lock for the whole batch
+        sem_wait(q->lock);
+        for (size_t i = 0; i < batch; i++) {
+            q->buf[q->in] = elems[pushed + i];
+            q->in = (q->in + 1) % q->SIZE;
+        }
+        sem_post(q->lock);
+        for (size_t i = 0; i < batch; i++)
+            sem_post(q->full_spaces);
+        pushed += batch;
+    }
+    return true;
+}
+
+/** @brief pop up to max elements from a queue at once.
+ *
+ *  @param q the queue to pop elements from.
+ *
+ *  @param out a place to assign the popped elements, in FIFO order.
+ *
+ *  @param max the number of elements out has room for.
+ *
+ *  @param got a place to assign the number of elements popped.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless the q or got parameter is NULL.
+ */
+bool queue_pop_many(queue_t *q, void **out, size_t max, size_t *got) {
+    if (!q || !got)
+        return false;
+    *got = 0;
+    if (!max)
+        return true;
+    // Wait until the queue is NOT empty, then take whatever other
+    // elements are there without waiting for more
+    sem_wait(q->full_spaces);
+    size_t batch = 1;
+    while (batch < max && !sem_trywait(q->full_spaces))
+        batch++;
+    // One trip through the lock for the whole batch
+    sem_wait(q->lock);
+    for (size_t i = 0; i < batch; i++) {
+        out[i] = q->buf[q->out];
+        q->out = (q->out + 1) % q->SIZE;
+    }
+    sem_post(q->lock);
+    for (size_t i = 0; i < batch; i++)
+        sem_post(q->empty_spaces);
+    *got = batch;
+    return true;
+}
@@ -62,3 +62,36 @@ bool queue_push(queue_t *q, void *elem);
  */
 bool queue_pop(queue_t *q, void **elem);
 
+/** @brief push several elements onto a queue, in order.  Each time the
+ *         queue has room, as many of them as fit are pushed at once,
+ *         so a batch pays for synchronization once rather than once
+ *         per element.  Blocks until all of them are pushed.
+ *
+ *  @param q the queue to push the elements into.
+ *
+ *  @param elems the elements to add to the queue, first one first.
+ *
+ *  @param n the number of elements in elems.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless the q parameter is NULL.
+ */
+bool queue_push_many(queue_t *q, void **elems, size_t n);
+
+/** @brief pop up to max elements from a queue at once.  Blocks until
+ *         at least one element is available, then pops as many of the
+ *         available ones as fit, oldest first.
+ *
+ *  @param q the queue to pop elements from.
+ *
+ *  @param out a place to assign the popped elements, in FIFO order.
+ *
+ *  @param max the number of elements out has room for.  If it's 0,
+ *         nothing is popped and the function doesn't block.
+ *
+ *  @param got a place to assign the number of elements popped.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless the q or got parameter is NULL.
+ */
+bool queue_pop_many(queue_t *q, void **out, size_t max, size_t *got);
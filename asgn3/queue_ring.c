@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include "queue.h"
+
+// Assumed cache line size; the counts, head and tail each get a line of their own
+#define CACHE_LINE 64
+
+// A counting semaphore that a batch can take from or give to n at a time. Taking and giving are
+// one atomic operation on value; the lock and condition variable are only used to sleep while
+// value is 0 and to wake the sleepers.
+struct count {
+    int64_t value;
+    int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t nonzero;
+};
+
+// A slot in the ring. seq says whose turn the slot is: it equals the position of the push
+// that may fill it, or that position + 1 once it's filled and the pop of that position may
+// empty it.
+struct cell {
+    uint64_t seq;
+    void *elem;
+};
+
+struct queue {
+    // Only read after queue_new, so every thread can keep a copy of this line
+    int SIZE;
+    struct cell *buf;
+    // Every push and pop updates both counts, so neither shares a line with anything else
+    _Alignas(CACHE_LINE) struct count full_spaces;
+    _Alignas(CACHE_LINE) struct count empty_spaces;
+    // Next position to push to, and to pop from. Producers only touch tail and consumers only
+    // head, so they're kept on separate cache lines.
+    _Alignas(CACHE_LINE) uint64_t tail;
+    _Alignas(CACHE_LINE) uint64_t head;
+};
+
+static void count_init(struct count *c, int64_t value) {
+    c->value = value;
+    c->sleepers = 0;
+    int ret = pthread_mutex_init(&c->lock, NULL);
+    assert(!ret);
+    ret = pthread_cond_init(&c->nonzero, NULL);
+    assert(!ret);
+}
+
+static void count_destroy(struct count *c) {
+    int ret = pthread_mutex_destroy(&c->lock);
+    assert(!ret);
+    ret = pthread_cond_destroy(&c->nonzero);
+    assert(!ret);
+}
+
+/** @brief Takes between 1 and max from a count, as much as it has, waiting while it is 0
+ *
+ *  @return the amount taken
+ */
+static int64_t count_take(struct count *c, int64_t max) {
+    int64_t v = __atomic_load_n(&c->value, __ATOMIC_SEQ_CST);
+    while (1) {
+        if (v > 0) {
+            int64_t take = v < max ? v : max;
+            // On failure v is reloaded
+            if (__atomic_compare_exchange_n(
+                    &c->value, &v, v - take, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                return take;
+            continue;
+        }
+        // Announce the sleeper before looking at value again, so that a count_give that adds
+        // to value after this either is seen here or sees the sleeper and wakes it
+        pthread_mutex_lock(&c->lock);
+        __atomic_add_fetch(&c->sleepers, 1, __ATOMIC_SEQ_CST);
+        while ((v = __atomic_load_n(&c->value, __ATOMIC_SEQ_CST)) <= 0)
+            pthread_cond_wait(&c->nonzero, &c->lock);
+        __atomic_sub_fetch(&c->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+/** @brief Adds n to a count, waking whoever sleeps waiting for it
+ */
+static void count_give(struct count *c, int64_t n) {
+    __atomic_add_fetch(&c->value, n, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&c->sleepers, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock(&c->lock);
+    if (n == 1)
+        pthread_cond_signal(&c->nonzero);
+    else
+        pthread_cond_broadcast(&c->nonzero);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/** @brief Dynamically allocates and initializes a new queue with a
+ *         maximum size, size
+ *
+ *  @param size the maximum size of the queue
+ *
+ *  @return a pointer to a new queue_t
+ */
+queue_t *queue_new(int size) {
+    struct queue *q = aligned_alloc(CACHE_LINE, sizeof(struct queue));
+    memset(q, 0, sizeof(struct queue));
+    q->SIZE = size;
+    q->buf = calloc(q->SIZE, sizeof(struct cell));
+    // Slot i is first filled by the push of position i
+    for (int i = 0; i < q->SIZE; i++)
+        q->buf[i].seq = i;
+
+    // The counts keep the blocking behavior of queue.c's semaphores: pushes wait while the
+    // queue is full and pops while it's empty. There is no lock; pushes and pops claim
+    // positions with an atomic add on tail or head.
+    count_init(&q->empty_spaces, q->SIZE);
+    count_init(&q->full_spaces, 0);
+
+    return q;
+}
+
+/** @brief Delete your queue and free all of its memory.
+ *
+ *  @param q the queue to be deleted.  Note, you should assign the
+ *  passed in pointer to NULL when returning (i.e., you should set
+ *  *q = NULL after deallocation).
+ *
+ */
+void queue_delete(queue_t **q) {
+    // Invalid queue
+    if (!q || !*q)
+        return;
+    // Free & destroy everything
+    free((*q)->buf);
+    count_destroy(&(*q)->full_spaces);
+    count_destroy(&(*q)->empty_spaces);
+
+    // Free & set to NULL
+    free(*q);
+    *q = NULL;
+}
+
+/** @brief Waits until a slot's sequence number reaches seq. A count was already taken for
+ *         it, so this only waits out a push or pop of the same slot, one lap earlier, that
+ *         claimed its position but hasn't finished copying.
+ */
+static void cell_wait(struct cell *c, uint64_t seq) {
+    while (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != seq)
+        sched_yield();
+}
+
+/** @brief push an element onto a queue
+ *
+ *  @param q the queue to push an element into.
+ *
+ *  @param elem th element to add to the queue
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless the q parameter is NULL.
+ */
+bool queue_push(queue_t *q, void *elem) {
+    if (!q)
+        return false;
+    // Wait until the queue is NOT full
+    count_take(&q->empty_spaces, 1);
+    uint64_t pos = __atomic_fetch_add(&q->tail, 1, __ATOMIC_RELAXED);
+    struct cell *c = &q->buf[pos % q->SIZE];
+    cell_wait(c, pos);
+    c->elem = elem;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+    count_give(&q->full_spaces, 1);
+    return true;
+}
+
+/** @brief pop an element from a queue.
+ *
+ *  @param q the queue to pop an element from.
+ *
+ *  @param elem a place to assign the poped element.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless the q parameter is NULL.
+ */
+bool queue_pop(queue_t *q, void **elem) {
+    if (!q)
+        return false;
+    // Wait until the queue is NOT empty
+    count_take(&q->full_spaces, 1);
+    uint64_t pos = __atomic_fetch_add(&q->head, 1, __ATOMIC_RELAXED);
+    struct cell *c = &q->buf[pos % q->SIZE];
+    cell_wait(c, pos + 1);
+    *elem = c->elem;
+    // Hand the slot to the push one lap later
+    __atomic_store_n(&c->seq, pos + q->SIZE, __ATOMIC_RELEASE);
+    count_give(&q->empty_spaces, 1);
+    return true;
+}
+
+/** @brief push several elements onto a queue, in order.
+ *
+ *  @param q the queue to push the elements into.
+ *
+ *  @param elems the elements to add to the queue, first one first.
+ *
+ *  @param n the number of elements in elems.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless the q parameter is NULL.
+ */
+bool queue_push_many(queue_t *q, void **elems, size_t n) {
+    if (!q)
+        return false;
+    size_t pushed = 0;
+    while (pushed < n) {
+        // Wait until the queue is NOT full, then take as many of the free spaces as the rest
+        // needs, all in one go
+        size_t batch = count_take(&q->empty_spaces, n - pushed);
+        // One atomic add claims consecutive positions for the whole batch
+        uint64_t pos = __atomic_fetch_add(&q->tail, batch, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < batch; i++) {
+            struct cell *c = &q->buf[(pos + i) % q->SIZE];
+            cell_wait(c, pos + i);
+            c->elem = elems[pushed + i];
+            __atomic_store_n(&c->seq, pos + i + 1, __ATOMIC_RELEASE);
+        }
+        count_give(&q->full_spaces, batch);
+        pushed += batch;
+    }
+    return true;
+}
+
+/** @brief pop up to max elements from a queue at once.
+ *
+ *  @param q the queue to pop elements from.
+ *
+ *  @param out a place to assign the popped elements, in FIFO order.
+ *
+ *  @param max the number of elements out has room for.
+ *
+ *  @param got a place to assign the number of elements popped.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless the q or got parameter is NULL.
+ */
+bool queue_pop_many(queue_t *q, void **out, size_t max, size_t *got) {
+    if (!q || !got)
+        return false;
+    *got = 0;
+    if (!max)
+        return true;
+    // Wait until the queue is NOT empty, then take up to max of the elements that are there,
+    // all in one go
+    size_t batch = count_take(&q->full_spaces, max);
+    // One atomic add claims consecutive positions for the whole batch
+    uint64_t pos = __atomic_fetch_add(&q->head, batch, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < batch; i++) {
+        struct cell *c = &q->buf[(pos + i) % q->SIZE];
+        cell_wait(c, pos + i + 1);
+        out[i] = c->elem;
+        __atomic_store_n(&c->seq, pos + i + q->SIZE, __ATOMIC_RELEASE);
+    }
+    count_give(&q->empty_spaces, batch);
+    *got = batch;
+    return true;
+}
@@ -0,0 +1,160 @@
+// Stress test for queue.h, run against whichever implementation queue.o was built from.
+// Producers push with queue_push and queue_push_many, in batches of varying size; consumers pop
+// with queue_pop and queue_pop_many. Every element must come out exactly once, and each
+// producer's elements in the order it pushed them, batches included.
+//
+// usage: queue_test [queue_size ...]
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "queue.h"
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+// Elements per producer
+#define PER_PRODUCER 100000
+// Largest batch a producer pushes, and a consumer pops
+#define MAX_BATCH 37
+#define MAX_POP 64
+// A batch larger than the edge-case queue of 4
+#define OVERSIZED 10
+
+static queue_t *q;
+// How many times each element came out
+static unsigned char seen[PRODUCERS][PER_PRODUCER];
+
+/** @brief Encodes producer id's i-th element. NULL is left for the consumers' stop signal.
+ */
+static void *element(uintptr_t id, uintptr_t i) {
+    return (void *) (id * PER_PRODUCER + i + 1);
+}
+
+/** @brief Pushes PER_PRODUCER elements in order, one at a time or in batches of 2 to MAX_BATCH
+ */
+static void *producer(void *arg) {
+    uintptr_t id = (uintptr_t) arg;
+    void *batch[MAX_BATCH];
+    uintptr_t i = 0;
+    while (i < PER_PRODUCER) {
+        size_t n = (i / 3) % MAX_BATCH + 1;
+        if (i + n > PER_PRODUCER)
+            n = PER_PRODUCER - i;
+        for (size_t k = 0; k < n; k++)
+            batch[k] = element(id, i + k);
+        bool ok = n == 1 ? queue_push(q, batch[0]) : queue_push_many(q, batch, n);
+        assert(ok);
+        i += n;
+    }
+    return NULL;
+}
+
+/** @brief Pops until it gets a stop signal, checking that each producer's elements arrive in
+ *         order. Odd consumers pop up to MAX_POP at a time, even ones 1 to 5.
+ */
+static void *consumer(void *arg) {
+    uintptr_t id = (uintptr_t) arg;
+    long last[PRODUCERS];
+    for (int p = 0; p < PRODUCERS; p++)
+        last[p] = -1;
+    void *batch[MAX_POP];
+    unsigned seed = id;
+    size_t stops = 0;
+    while (!stops) {
+        size_t max = id % 2 ? MAX_POP : 1 + rand_r(&seed) % 5;
+        size_t got = 1;
+        bool ok = max == 1 ? queue_pop(q, &batch[0]) : queue_pop_many(q, batch, max, &got);
+        assert(ok && got >= 1 && got <= max);
+        for (size_t k = 0; k < got; k++) {
+            if (!batch[k]) {
+                stops++;
+                continue;
+            }
+            uintptr_t v = (uintptr_t) batch[k] - 1;
+            long p = v / PER_PRODUCER, i = v % PER_PRODUCER;
+            assert(!stops && i > last[p]);
+            last[p] = i;
+            __atomic_add_fetch(&seen[p][i], 1, __ATOMIC_RELAXED);
+        }
+    }
+    // Hand back the stop signals meant for other consumers
+    while (--stops)
+        queue_push(q, NULL);
+    return NULL;
+}
+
+/** @brief Runs the producers and consumers over a queue of the given size
+ */
+static void run(int size) {
+    q = queue_new(size);
+    for (int p = 0; p < PRODUCERS; p++)
+        for (int i = 0; i < PER_PRODUCER; i++)
+            seen[p][i] = 0;
+
+    pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+    for (uintptr_t i = 0; i < PRODUCERS; i++)
+        pthread_create(&producers[i], NULL, producer, (void *) i);
+    for (uintptr_t i = 0; i < CONSUMERS; i++)
+        pthread_create(&consumers[i], NULL, consumer, (void *) i);
+    for (int i = 0; i < PRODUCERS; i++)
+        pthread_join(producers[i], NULL);
+    // Everything pushed comes out before these
+    for (int i = 0; i < CONSUMERS; i++)
+        queue_push(q, NULL);
+    for (int i = 0; i < CONSUMERS; i++)
+        pthread_join(consumers[i], NULL);
+
+    for (int p = 0; p < PRODUCERS; p++)
+        for (int i = 0; i < PER_PRODUCER; i++)
+            assert(seen[p][i] == 1);
+    queue_delete(&q);
+    assert(!q);
+    fprintf(stderr, "PASSED stress with a queue of %d\n", size);
+}
+
+/** @brief Pushes arg's OVERSIZED elements in one call, more than the queue holds
+ */
+static void *push_oversized(void *arg) {
+    queue_push_many(q, arg, OVERSIZED);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    // Edge cases of the batch calls
+    q = queue_new(4);
+    void *x = NULL;
+    size_t got = 99;
+    bool ok = queue_pop_many(q, &x, 0, &got);
+    assert(ok && got == 0);
+    ok = queue_push_many(q, &x, 0);
+    assert(ok);
+    ok = queue_pop_many(NULL, &x, 1, &got) || queue_pop_many(q, &x, 1, NULL)
+         || queue_push_many(NULL, &x, 1);
+    assert(!ok);
+
+    // A batch larger than the queue goes in as several, in order
+    void *in[OVERSIZED];
+    for (uintptr_t i = 0; i < OVERSIZED; i++)
+        in[i] = (void *) (i + 1);
+    pthread_t tid;
+    pthread_create(&tid, NULL, push_oversized, in);
+    for (uintptr_t i = 0; i < OVERSIZED; i++) {
+        ok = queue_pop(q, &x);
+        assert(ok && x == in[i]);
+    }
+    pthread_join(tid, NULL);
+    queue_delete(&q);
+    fprintf(stderr, "PASSED batch edge cases\n");
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++)
+            run(atoi(argv[i]));
+    } else {
+        int sizes[] = { 1, 2, 3, 64 };
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+            run(sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include "alloc.h"
+
+#ifdef ALLOC_STATS
+
+#include "asgn2_helper_funcs.h"
+#include "httpserver.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Size classes: up to 16 bytes, up to 32, ... up to 1 MiB, and larger
+#define ALLOC_CLASSES 18
+// Threads with counters of their own; any others share one set
+#define ALLOC_THREADS 256
+
+// glibc's allocator under its internal names, which the wrappers below forward to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static const char *phase_names[ALLOC_PHASES]
+    = { "none", "recv", "GET", "PUT", "POST", "PATCH", "other" };
+
+typedef struct {
+    uint64_t requests[ALLOC_PHASES];
+    uint64_t allocs[ALLOC_PHASES];
+    uint64_t bytes[ALLOC_PHASES];
+    uint64_t frees[ALLOC_PHASES];
+    uint64_t classes[ALLOC_PHASES][ALLOC_CLASSES];
+} alloc_counters_t;
+
+static alloc_counters_t thread_counters[ALLOC_THREADS];
+static alloc_counters_t shared_counters;
+static unsigned threads_used;
+
+static __thread alloc_counters_t *mine;
+static __thread alloc_phase_t phase;
+
+// The calling thread's receive counters when it started receiving its current request
+static __thread struct {
+    uint64_t allocs, bytes, frees, classes[ALLOC_CLASSES];
+} recv_start;
+
+/** @brief The calling thread's counters, claimed on its first allocation. Counters are only
+ *         written by their thread, but read by GET /.allocs, so updates are still atomic.
+ */
+static alloc_counters_t *alloc_counters(void) {
+    if (!mine) {
+        unsigned i = __atomic_fetch_add(&threads_used, 1, __ATOMIC_RELAXED);
+        mine = i < ALLOC_THREADS ? &thread_counters[i] : &shared_counters;
+    }
+    return mine;
+}
+
+static unsigned alloc_class(size_t size) {
+    unsigned c = 0;
+    while (c < ALLOC_CLASSES - 1 && size > ((size_t) 16 << c))
+        c++;
+    return c;
+}
+
+static void alloc_count(size_t size) {
+    alloc_counters_t *ac = alloc_counters();
+    __atomic_add_fetch(&ac->allocs[phase], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ac->bytes[phase], size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ac->classes[phase][alloc_class(size)], 1, __ATOMIC_RELAXED);
+}
+
+// The server, the helper library and libc itself all allocate through these
+void *malloc(size_t size) {
+    alloc_count(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    // nmemb * size would wrap and be counted as a small allocation
+    if (size && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    alloc_count(nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    alloc_count(size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr)
+        __atomic_add_fetch(&alloc_counters()->frees[phase], 1, __ATOMIC_RELAXED);
+    __libc_free(ptr);
+}
+
+void alloc_phase(alloc_phase_t p) {
+    if (p == ALLOC_PHASE_RECV) {
+        alloc_counters_t *ac = alloc_counters();
+        recv_start.allocs = ac->allocs[p];
+        recv_start.bytes = ac->bytes[p];
+        recv_start.frees = ac->frees[p];
+        memcpy(recv_start.classes, ac->classes[p], sizeof(recv_start.classes));
+    }
+    phase = p;
+}
+
+/** @brief Takes back what the calling thread counted while receiving its current request
+ */
+static void alloc_uncount_recv(void) {
+    alloc_counters_t *ac = alloc_counters();
+    alloc_phase_t p = ALLOC_PHASE_RECV;
+    __atomic_store_n(&ac->allocs[p], recv_start.allocs, __ATOMIC_RELAXED);
+    __atomic_store_n(&ac->bytes[p], recv_start.bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&ac->frees[p], recv_start.frees, __ATOMIC_RELAXED);
+    for (int c = 0; c < ALLOC_CLASSES; c++)
+        __atomic_store_n(&ac->classes[p][c], recv_start.classes[c], __ATOMIC_RELAXED);
+}
+
+void alloc_request(task_t *t) {
+    alloc_phase_t p = ALLOC_PHASE_OTHER;
+    const Request_t *req = t->res ? NULL : conn_get_request(t->conn);
+    if (req == &REQUEST_GET)
+        p = ALLOC_PHASE_GET;
+    else if (req == &REQUEST_PUT)
+        p = ALLOC_PHASE_PUT;
+    else if (!t->res && head_is_method(&t->head, "POST"))
+        p = ALLOC_PHASE_POST;
+    else if (!t->res && head_is_method(&t->head, "PATCH"))
+        p = ALLOC_PHASE_PATCH;
+    __atomic_add_fetch(&alloc_counters()->requests[p], 1, __ATOMIC_RELAXED);
+    phase = p;
+}
+
+/** @brief Sums one counter over every thread
+ */
+static uint64_t alloc_sum(size_t offset) {
+    uint64_t *shared = (uint64_t *) ((char *) &shared_counters + offset);
+    uint64_t sum = __atomic_load_n(shared, __ATOMIC_RELAXED);
+    unsigned threads = __atomic_load_n(&threads_used, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < threads && i < ALLOC_THREADS; i++) {
+        uint64_t *counter = (uint64_t *) ((char *) &thread_counters[i] + offset);
+        sum += __atomic_load_n(counter, __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+#define ALLOC_SUM(field) alloc_sum(offsetof(alloc_counters_t, field))
+
+bool alloc_serve(task_t *t) {
+    if (strcmp(conn_get_uri(t->conn), ALLOC_STATS_URI))
+        return false;
+    // Neither this request nor the page's own allocations belong in the numbers
+    __atomic_sub_fetch(&alloc_counters()->requests[ALLOC_PHASE_GET], 1, __ATOMIC_RELAXED);
+    alloc_uncount_recv();
+    phase = ALLOC_PHASE_NONE;
+
+    uint64_t requests[ALLOC_PHASES], handled = 0;
+    for (int p = 0; p < ALLOC_PHASES; p++) {
+        requests[p] = ALLOC_SUM(requests[p]);
+        handled += requests[p];
+    }
+    // Every handled request was received first
+    requests[ALLOC_PHASE_RECV] = handled;
+
+    static const int budgets[ALLOC_PHASES] = {
+        [ALLOC_PHASE_RECV] = ALLOC_BUDGET_RECV,
+        [ALLOC_PHASE_GET] = ALLOC_BUDGET_GET,
+        [ALLOC_PHASE_PUT] = ALLOC_BUDGET_PUT,
+    };
+    char body[8192];
+    int len = snprintf(body, sizeof(body), "%-6s %10s %10s %10s %10s %10s %6s\n", "phase",
+        "requests", "allocs", "allocs/req", "bytes/req", "frees/req", "budget");
+    bool over = false;
+    for (int p = 0; p < ALLOC_PHASES; p++) {
+        uint64_t allocs = ALLOC_SUM(allocs[p]);
+        double n = requests[p] ? requests[p] : 1;
+        len += snprintf(body + len, sizeof(body) - len, "%-6s %10lu %10lu %10.2f %10.1f %10.2f",
+            phase_names[p], (unsigned long) requests[p], (unsigned long) allocs, allocs / n,
+            ALLOC_SUM(bytes[p]) / n, ALLOC_SUM(frees[p]) / n);
+        if (budgets[p]) {
+            bool ok = !requests[p] || allocs / n <= budgets[p];
+            over |= !ok;
+            len += snprintf(
+                body + len, sizeof(body) - len, " %3d %s", budgets[p], ok ? "ok" : "OVER");
+        }
+        len += snprintf(body + len, sizeof(body) - len, "\n");
+    }
+
+    len += snprintf(body + len, sizeof(body) - len, "\nallocations by size (bytes, up to)\n%-6s",
+        "phase");
+    for (int c = 0; c < ALLOC_CLASSES - 1; c++)
+        len += snprintf(body + len, sizeof(body) - len, " %7lu", 16UL << c);
+    len += snprintf(body + len, sizeof(body) - len, " %7s\n", "more");
+    for (int p = 0; p < ALLOC_PHASES; p++) {
+        len += snprintf(body + len, sizeof(body) - len, "%-6s", phase_names[p]);
+        for (int c = 0; c < ALLOC_CLASSES; c++)
+            len += snprintf(
+                body + len, sizeof(body) - len, " %7lu", (unsigned long) ALLOC_SUM(classes[p][c]));
+        len += snprintf(body + len, sizeof(body) - len, "\n");
+    }
+    len += snprintf(body + len, sizeof(body) - len, "\nbudget %s\n", over ? "exceeded" : "ok");
+
+    uint16_t code = 200;
+    if (send_ok_header(t->connfd, len) || write_all(t->connfd, body, len) != len)
+        code = 500;
+    write_to_audit_code(t->conn, "GET", ALLOC_STATS_URI, code);
+    return true;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "task.h"
+
+#include <stdbool.h>
+
+// Allocation accounting page served at GET /.allocs in ALLOC_STATS builds
+#define ALLOC_STATS_URI ".allocs"
+
+// Average allocations per request that GET /.allocs reports as within budget, checked by
+// make check ALLOC_STATS=1. Receiving covers task_new (peeking and parsing the head) and, in
+// staged mode, spooling the body; the others cover the handler of that method. Nearly all of
+// receiving's share is the helper library's conn_parse, which compiles its request regex for
+// every request: 5893 allocations for a GET from curl and about 6400 for a PUT, so its budget
+// only catches regressions of several hundred allocations per request.
+#define ALLOC_BUDGET_RECV 7000
+#define ALLOC_BUDGET_GET 4
+#define ALLOC_BUDGET_PUT 2
+
+// What a thread is doing, for attributing its allocations
+typedef enum {
+    ALLOC_PHASE_NONE,
+    ALLOC_PHASE_RECV,
+    ALLOC_PHASE_GET,
+    ALLOC_PHASE_PUT,
+    ALLOC_PHASE_POST,
+    ALLOC_PHASE_PATCH,
+    ALLOC_PHASE_OTHER,
+    ALLOC_PHASES
+} alloc_phase_t;
+
+#ifdef ALLOC_STATS
+
+/** @brief Sets the phase the calling thread's allocations are counted under. Threads start
+ *         in ALLOC_PHASE_NONE, which is where background work (timers, replication,
+ *         warm-up, the fd cache's watcher) is counted.
+ */
+void alloc_phase(alloc_phase_t phase);
+
+/** @brief Counts one request of t's method and switches to its phase
+ */
+void alloc_request(task_t *t);
+
+/** @brief Serves GET /.allocs: per phase, requests, allocations, bytes and frees per request,
+ *         a size-class histogram, and whether the averages are within the ALLOC_BUDGET_*
+ *         limits. The page itself is not counted.
+ *
+ *  @return false if the request is not for it
+ */
+bool alloc_serve(task_t *t);
+
+#else
+
+#define alloc_phase(phase) ((void) 0)
+#define alloc_request(t) ((void) 0)
+#define alloc_serve(t) false
+
+#endif
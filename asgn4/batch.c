@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include "batch.h"
+#include "asgn2_helper_funcs.h"
+#include "fdcache.h"
+#include "httpserver.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define BATCH_MAX_BODY   8192
+#define BATCH_MAX_ITEMS  256
+#define BATCH_READERS    8
+// Items up to this size are read into memory by the readers; larger ones
+// keep their shared lock and are streamed when their turn comes.
+#define BATCH_INLINE_MAX (64 * 1024)
+
+typedef struct {
+    char uri[64];
+    uint16_t code;
+    // Held (shared lock) until sent, for items too large to read up front
+    fd_ref_t ref;
+    size_t size;
+    char *data;
+} batch_item_t;
+
+typedef struct {
+    batch_item_t *items;
+    size_t count;
+    size_t next;
+} batch_t;
+
+/** @brief Checks that a URI follows the same grammar conn_parse enforces
+ *
+ *  @return true if uri is 1-63 characters of [a-zA-Z0-9.-]
+ */
+static bool batch_valid_uri(const char *uri, size_t len) {
+    if (len < 1 || len > 63)
+        return false;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char) uri[i]) && uri[i] != '.' && uri[i] != '-')
+            return false;
+    }
+    return true;
+}
+
+/** @brief Opens, locks and (if small) reads one item, the same way handle_get does for a
+ *         single URI
+ */
+static void batch_open_item(batch_item_t *item) {
+    const Response_t *res = fdcache_open(item->uri, &item->ref);
+    if (res) {
+        item->code = response_get_code(res);
+        return;
+    }
+    item->size = item->ref.st.st_size;
+    item->code = 200;
+    if (item->size > BATCH_INLINE_MAX)
+        return;
+
+    item->data = malloc(item->size ? item->size : 1);
+    if (!item->data) {
+        item->code = 500;
+        item->size = 0;
+        fdcache_close(&item->ref);
+        return;
+    }
+    size_t off = 0;
+    while (off < item->size) {
+        ssize_t n = pread(item->ref.fd, item->data + off, item->size - off, off);
+        if (n <= 0) {
+            item->code = 500;
+            item->size = 0;
+            break;
+        }
+        off += n;
+    }
+    fdcache_close(&item->ref);
+}
+
+/** @brief Reader thread: claims items until the batch is exhausted
+ */
+static void *batch_reader(void *arg) {
+    batch_t *b = arg;
+    while (1) {
+        size_t i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+        if (i >= b->count)
+            break;
+        // Malformed URIs were already answered by batch_parse
+        if (b->items[i].code != 400)
+            batch_open_item(&b->items[i]);
+    }
+    return NULL;
+}
+
+/** @brief Splits the request body into items
+ *
+ *  @return number of items, or -1 if there are too many
+ */
+static ssize_t batch_parse(char *body, batch_item_t *items) {
+    size_t count = 0;
+    char *save = NULL;
+    for (char *line = strtok_r(body, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        size_t len = strcspn(line, "\r");
+        if (*line == '/') {
+            line++;
+            len = len ? len - 1 : 0;
+        }
+        if (!len)
+            continue;
+        if (count == BATCH_MAX_ITEMS)
+            return -1;
+        batch_item_t *item = &items[count++];
+        memset(item, 0, sizeof(*item));
+        item->ref.fd = -1;
+        if (batch_valid_uri(line, len)) {
+            memcpy(item->uri, line, len);
+        } else {
+            // Keep something printable for the frame and the audit log
+            snprintf(item->uri, sizeof(item->uri), "%.*s", (int) (len < 63 ? len : 63), line);
+            for (char *c = item->uri; *c; c++) {
+                if (!isgraph((unsigned char) *c))
+                    *c = '_';
+            }
+            item->code = 400;
+        }
+    }
+    return count;
+}
+
+/** @brief Handles a batch read (see batch.h)
+ */
+void handle_batch(task_t *t) {
+    conn_t *conn = t->conn;
+    int connfd = t->connfd;
+    const Response_t *res = NULL;
+    char *cl = conn_get_header(conn, "Content-Length");
+    char *end = NULL;
+    long long len = cl ? strtoll(cl, &end, 10) : -1;
+    if (len < 0 || len > BATCH_MAX_BODY || (end && *end != '\0')) {
+        res = &RESPONSE_BAD_REQUEST;
+        goto out_failed;
+    }
+
+    // Bodies are only handed out through a file descriptor
+    int memfd = memfd_create("batch", 0);
+    if (memfd < 0) {
+        res = &RESPONSE_INTERNAL_SERVER_ERROR;
+        goto out_failed;
+    }
+    res = task_recv_body(t, memfd);
+    char body[BATCH_MAX_BODY + 1];
+    ssize_t n = res ? -1 : pread(memfd, body, len, 0);
+    close(memfd);
+    if (res)
+        goto out_failed;
+    if (n != len) {
+        res = &RESPONSE_BAD_REQUEST;
+        goto out_failed;
+    }
+    body[n] = '\0';
+
+    batch_item_t *items = calloc(BATCH_MAX_ITEMS, sizeof(batch_item_t));
+    ssize_t count = batch_parse(body, items);
+    if (count < 0) {
+        free(items);
+        res = &RESPONSE_BAD_REQUEST;
+        goto out_failed;
+    }
+
+    // Open and read every item concurrently
+    batch_t b = { .items = items, .count = count, .next = 0 };
+    size_t nreaders = count < BATCH_READERS ? (size_t) count : BATCH_READERS;
+    pthread_t readers[BATCH_READERS];
+    size_t started = 0;
+    for (size_t i = 1; i < nreaders; i++) {
+        if (pthread_create(&readers[started], NULL, batch_reader, &b) == 0)
+            started++;
+    }
+    batch_reader(&b);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(readers[i], NULL);
+
+    // Every size is known now, so the response can carry a Content-Length
+    char frame[96];
+    size_t total = 0;
+    for (ssize_t i = 0; i < count; i++) {
+        total += snprintf(frame, sizeof(frame), "%u %s %zu\r\n", items[i].code, items[i].uri,
+            items[i].size);
+        total += items[i].size;
+    }
+    bool ok = !send_ok_header(connfd, total);
+
+    for (ssize_t i = 0; i < count; i++) {
+        batch_item_t *item = &items[i];
+        int flen = snprintf(
+            frame, sizeof(frame), "%u %s %zu\r\n", item->code, item->uri, item->size);
+        ok = ok && write_all(connfd, frame, flen) == flen;
+        if (item->ref.fd >= 0) {
+            ok = ok && !sendfile_all(connfd, item->ref.fd, 0, item->size);
+            fdcache_close(&item->ref);
+        } else if (item->size) {
+            ok = ok && write_all(connfd, item->data, item->size) == (ssize_t) item->size;
+        }
+        free(item->data);
+        write_to_audit_code(conn, "GET", item->uri, item->code);
+    }
+    free(items);
+    return;
+
+out_failed:
+    write_to_audit_code(conn, "POST", BATCH_URI, response_get_code(res));
+    conn_send_response(conn, res);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "task.h"
+
+// URI that batch reads are POSTed to
+#define BATCH_URI ".batch"
+
+/** @brief Handles a batch read: POST /.batch whose body is a newline
+ *         separated list of URIs. Every item is opened and read by a small
+ *         set of reader threads and the results are streamed back in a
+ *         single 200 OK response made of length-prefixed frames:
+ *
+ *             <status> <uri> <length>\r\n<length bytes of body>
+ *
+ *         Non-200 items carry a zero length. Every item gets its own line
+ *         in the audit log.
+ *
+ *  @param t the parsed request; frames are written to t->connfd
+ */
+void handle_batch(task_t *t);
@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include "bigput.h"
+#include "layout.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// O_DIRECT needs buffer addresses, offsets and lengths aligned to the logical block size
+#define BIGPUT_ALIGN 4096
+#define BIGPUT_BUF   (1024 * 1024)
+
+static uint64_t direct_threshold;
+
+/** @brief Sets the O_DIRECT threshold
+ */
+void bigput_set_direct_threshold(uint64_t bytes) {
+    direct_threshold = bytes;
+}
+
+/** @brief Whether a body of len bytes should be streamed with O_DIRECT
+ */
+bool bigput_use_direct(uint64_t len) {
+    return direct_threshold && len >= direct_threshold;
+}
+
+/** @brief Reserves len bytes for fd
+ *
+ *  @return 0, or the status to fail the request with
+ */
+uint16_t bigput_prealloc(int fd, uint64_t len) {
+    if (!fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, len))
+        return 0;
+    if (errno == ENOSPC || errno == EDQUOT)
+        return 507;
+    if (errno == EFBIG)
+        return 413;
+    // EOPNOTSUPP and friends: just write it the slow way
+    return 0;
+}
+
+typedef struct {
+    task_t *t;
+    int pipe_w;
+    const Response_t *res;
+} bigput_recv_t;
+
+/** @brief Network side of the pipeline: client -> pipe
+ */
+static void *bigput_receiver(void *arg) {
+    bigput_recv_t *r = arg;
+    r->res = task_recv_body(r->t, r->pipe_w);
+    close(r->pipe_w);
+    return NULL;
+}
+
+/** @brief Reads from the pipe until buf is full or the pipe is drained
+ *
+ *  @return bytes read, or -1
+ */
+static ssize_t bigput_fill(int pipe_r, char *buf, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(pipe_r, buf + got, size - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/** @brief Whether n bytes at buf are all zero. memcmp against itself shifted by one byte
+ *         runs at libc's vectorized memcmp speed.
+ */
+static bool bigput_is_zero(const char *buf, size_t n) {
+    return n == 0 || (buf[0] == 0 && !memcmp(buf, buf + 1, n - 1));
+}
+
+/** @brief Makes [off, off + n) of fd read as zeros without writing them: punches a hole, or
+ *         writes zeros where the file system can't
+ *
+ *  @return 0 on success, -1 on error
+ */
+static int bigput_zero_range(int fd, uint64_t off, uint64_t n) {
+    static const char zeros[BIGPUT_ALIGN * 16];
+    if (!n || !fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, n))
+        return 0;
+    while (n) {
+        size_t chunk = n < sizeof(zeros) ? n : sizeof(zeros);
+        ssize_t w = pwrite(fd, zeros, chunk, off);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        off += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/** @brief Streams a len byte body into the file (see bigput.h). Full aligned blocks go through
+ *         dfd, which may be an O_DIRECT descriptor, and the unaligned tail through fd.
+ *
+ *  @return NULL on success, otherwise the response to send
+ */
+static const Response_t *bigput_stream(task_t *t, int fd, int dfd, uint64_t len) {
+    // Holes can only be punched below the end of file (on ext4, at least), so the file gets
+    // its final size first. Its old tail, if any, is going away anyway.
+    if (ftruncate(fd, len))
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+
+    char *buf;
+    int pipefd[2];
+    if (posix_memalign((void **) &buf, BIGPUT_ALIGN, BIGPUT_BUF))
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+    if (pipe(pipefd)) {
+        free(buf);
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+    }
+    // Let the receiver run a whole buffer ahead of the disk
+    fcntl(pipefd[1], F_SETPIPE_SZ, BIGPUT_BUF);
+
+    bigput_recv_t r = { .t = t, .pipe_w = pipefd[1], .res = NULL };
+    pthread_t receiver;
+    if (pthread_create(&receiver, NULL, bigput_receiver, &r)) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        free(buf);
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+    }
+
+    const Response_t *res = NULL;
+    uint64_t off = 0;
+    // Start of the run of all-zero blocks that ends at off, written out as one hole
+    uint64_t zero_from = 0;
+    while (off < len) {
+        ssize_t n = bigput_fill(pipefd[0], buf, BIGPUT_BUF);
+        if (n <= 0) {
+            res = &RESPONSE_BAD_REQUEST;
+            break;
+        }
+        // Every chunk but the last is a whole buffer, so blocks stay aligned to the file
+        size_t aligned = n & ~(size_t) (BIGPUT_ALIGN - 1);
+        for (size_t b = 0; b < aligned && !res;) {
+            size_t e = b;
+            while (e < aligned && !bigput_is_zero(buf + e, BIGPUT_ALIGN))
+                e += BIGPUT_ALIGN;
+            if (e > b) {
+                if (bigput_zero_range(fd, zero_from, off + b - zero_from)
+                    || pwrite(dfd, buf + b, e - b, off + b) != (ssize_t) (e - b))
+                    res = &RESPONSE_INTERNAL_SERVER_ERROR;
+                zero_from = off + e;
+            }
+            b = e + BIGPUT_ALIGN;
+        }
+        if (res)
+            break;
+        off += aligned;
+        if ((size_t) n > aligned) {
+            // Only the very last chunk can be unaligned; it goes through the page cache
+            if (bigput_zero_range(fd, zero_from, off - zero_from)
+                || pwrite(fd, buf + aligned, n - aligned, off) != (ssize_t) (n - aligned)) {
+                res = &RESPONSE_INTERNAL_SERVER_ERROR;
+                break;
+            }
+            off += n - aligned;
+            zero_from = off;
+        }
+    }
+    if (!res && bigput_zero_range(fd, zero_from, off - zero_from))
+        res = &RESPONSE_INTERNAL_SERVER_ERROR;
+
+    // Unblock the receiver if we stopped early, then collect its verdict
+    close(pipefd[0]);
+    pthread_join(receiver, NULL);
+    free(buf);
+    return r.res ? r.res : res;
+}
+
+/** @brief Streams a body into uri with aligned O_DIRECT writes (see bigput.h)
+ *
+ *  @return NULL on success, otherwise the response to send
+ */
+const Response_t *bigput_recv_direct(task_t *t, const char *uri, int fd, uint64_t len) {
+    int dfd = layout_open(uri, O_WRONLY | O_DIRECT, 0);
+    if (dfd < 0)
+        return &RESPONSE_NOT_IMPLEMENTED;
+    const Response_t *res = bigput_stream(t, fd, dfd, len);
+    close(dfd);
+    return res;
+}
+
+/** @brief Streams a body into fd, leaving holes where it is all zeros (see bigput.h)
+ *
+ *  @return NULL on success, otherwise the response to send
+ */
+const Response_t *bigput_recv_sparse(task_t *t, int fd, uint64_t len) {
+    return bigput_stream(t, fd, fd, len);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "task.h"
+
+#include <stdint.h>
+
+// PUTs declaring at least this many bytes get their space fallocate()d up front
+#define BIGPUT_PREALLOC_MIN (1024 * 1024)
+
+/** @brief Sets the Content-Length at and above which PUT bodies are written
+ *         with O_DIRECT. 0 (the default) never uses O_DIRECT.
+ */
+void bigput_set_direct_threshold(uint64_t bytes);
+
+/** @brief Whether a body of len bytes should be streamed with O_DIRECT
+ */
+bool bigput_use_direct(uint64_t len);
+
+/** @brief Reserves len bytes for fd with fallocate (FALLOC_FL_KEEP_SIZE, so
+ *         the old contents stay visible until they are overwritten).
+ *
+ *  @return 0 on success or when the file system can't preallocate, and
+ *          otherwise the status to fail the request with before reading any
+ *          of the body: 507 when the disk or quota is full, 413 when the
+ *          file would be too large.
+ */
+uint16_t bigput_prealloc(int fd, uint64_t len);
+
+/** @brief Streams a len byte body into uri with aligned O_DIRECT writes.
+ *
+ *         A helper thread receives the body from the client into a pipe,
+ *         so socket reads continue while the previous block is written.
+ *         Each full, aligned buffer taken off the pipe is written with
+ *         O_DIRECT through a second descriptor. The unaligned tail goes
+ *         through fd. All-zero blocks are skipped as in bigput_recv_sparse.
+ *         The caller must already hold fd's exclusive lock.
+ *
+ *  @return NULL on success, otherwise the response to send. Returns
+ *          &RESPONSE_NOT_IMPLEMENTED without reading anything if the file
+ *          system does not support O_DIRECT, so the caller can fall back.
+ */
+const Response_t *bigput_recv_direct(task_t *t, const char *uri, int fd, uint64_t len);
+
+/** @brief Streams a len byte body into fd, starting at offset 0, without writing its
+ *         all-zero blocks.
+ *
+ *         The body is received into a pipe by a helper thread, as in
+ *         bigput_recv_direct, and checked one 4 KiB block at a time. Runs
+ *         of non-zero blocks are written. Each run of zero blocks becomes
+ *         a single FALLOC_FL_PUNCH_HOLE, which also drops whatever was
+ *         there before (old contents, or the space bigput_prealloc
+ *         reserved). If the file system can't punch holes, zeros are
+ *         written instead. fd is resized to len first, because holes can
+ *         only be punched below the end of file. The caller must hold fd's
+ *         exclusive lock.
+ *
+ *  @return NULL on success, otherwise the response to send
+ */
+const Response_t *bigput_recv_sparse(task_t *t, int fd, uint64_t len);
@@ -0,0 +1,172 @@
+#include "coalesce.h"
+#include "httpserver.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COALESCE_BUCKETS 64
+
+typedef struct waiter {
+    uint64_t key;
+    // Set when this waiter may write (go) or has been overtaken (superseded)
+    bool go;
+    bool superseded;
+    pthread_cond_t cv;
+} waiter_t;
+
+typedef struct slot {
+    char uri[64];
+    // A PUT for this URI is being written, and its ordering key
+    bool busy;
+    uint64_t key;
+    // Newest PUT waiting for the current write to finish
+    waiter_t *pending;
+    struct slot *next;
+} slot_t;
+
+static coalesce_order_t coalesce_order = COALESCE_OFF;
+static pthread_mutex_t coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static slot_t *slots[COALESCE_BUCKETS];
+
+/** @brief Turns on last-writer-wins coalescing
+ */
+void coalesce_init(coalesce_order_t order) {
+    coalesce_order = order;
+}
+
+/** @brief Whether coalescing is on
+ */
+bool coalesce_enabled(void) {
+    return coalesce_order != COALESCE_OFF;
+}
+
+/** @brief Hashes a URI to its bucket
+ */
+static size_t coalesce_bucket(const char *uri) {
+    size_t h = 5381;
+    for (; *uri; uri++)
+        h = h * 33 + (unsigned char) *uri;
+    return h % COALESCE_BUCKETS;
+}
+
+/** @brief Finds (or creates) the slot for uri. Must hold coalesce_lock.
+ *
+ *  @return the slot, or NULL if out of memory
+ */
+static slot_t *coalesce_slot(const char *uri) {
+    size_t b = coalesce_bucket(uri);
+    slot_t *s = slots[b];
+    while (s && strcmp(s->uri, uri))
+        s = s->next;
+    if (!s) {
+        s = calloc(1, sizeof(slot_t));
+        if (!s)
+            return NULL;
+        snprintf(s->uri, sizeof(s->uri), "%s", uri);
+        s->next = slots[b];
+        slots[b] = s;
+    }
+    return s;
+}
+
+/** @brief Frees an idle slot. Must hold coalesce_lock.
+ */
+static void coalesce_release(slot_t *s) {
+    slot_t **pp = &slots[coalesce_bucket(s->uri)];
+    while (*pp != s)
+        pp = &(*pp)->next;
+    *pp = s->next;
+    free(s);
+}
+
+/** @brief Answers a PUT that was overtaken by a newer one before it was written
+ */
+static uint16_t coalesce_ack(task_t *t) {
+    uint16_t code = write_to_audit(t->conn, &RESPONSE_OK);
+    conn_send_response(t->conn, &RESPONSE_OK);
+    return code;
+}
+
+/** @brief Writes t, then hands the URI to the newest pending PUT, if any
+ */
+static uint16_t coalesce_write(task_t *t, slot_t *s) {
+    uint16_t code = handle_put_now(t);
+
+    pthread_mutex_lock(&coalesce_lock);
+    if (s->pending) {
+        s->key = s->pending->key;
+        s->pending->go = true;
+        pthread_cond_signal(&s->pending->cv);
+        s->pending = NULL;
+    } else {
+        s->busy = false;
+        coalesce_release(s);
+    }
+    pthread_mutex_unlock(&coalesce_lock);
+    return code;
+}
+
+/** @brief Runs a PUT through the coalescer (see coalesce.h)
+ */
+uint16_t coalesce_put(task_t *t) {
+    uint64_t key = t->seq;
+    if (coalesce_order == COALESCE_REQUEST_ID) {
+        char *rid = conn_get_header(t->conn, "Request-Id");
+        char *end = NULL;
+        key = rid ? strtoull(rid, &end, 10) : 0;
+        // Without a usable Request-Id there is nothing to order by
+        if (!rid || *end != '\0')
+            return handle_put_now(t);
+    }
+
+    uint16_t code = expect_rejected(t);
+    if (code)
+        return code;
+
+    // Superseded writes are acknowledged once their bodies are drained, never before
+    const Response_t *res = task_spool_body(t);
+    if (res) {
+        code = write_to_audit(t->conn, res);
+        conn_send_response(t->conn, res);
+        return code;
+    }
+
+    pthread_mutex_lock(&coalesce_lock);
+    slot_t *s = coalesce_slot(conn_get_uri(t->conn));
+    if (!s) {
+        pthread_mutex_unlock(&coalesce_lock);
+        code = write_to_audit(t->conn, &RESPONSE_INTERNAL_SERVER_ERROR);
+        conn_send_response(t->conn, &RESPONSE_INTERNAL_SERVER_ERROR);
+        return code;
+    }
+    if (!s->busy) {
+        s->busy = true;
+        s->key = key;
+        pthread_mutex_unlock(&coalesce_lock);
+        return coalesce_write(t, s);
+    }
+
+    // Someone is writing: a newer write or pending PUT makes us obsolete, an older pending one
+    // is made obsolete by us
+    if (s->key > key || (s->pending && s->pending->key > key)) {
+        pthread_mutex_unlock(&coalesce_lock);
+        return coalesce_ack(t);
+    }
+    waiter_t w = { .key = key, .go = false, .superseded = false };
+    pthread_cond_init(&w.cv, NULL);
+    if (s->pending) {
+        s->pending->superseded = true;
+        pthread_cond_signal(&s->pending->cv);
+    }
+    s->pending = &w;
+    while (!w.go && !w.superseded)
+        pthread_cond_wait(&w.cv, &coalesce_lock);
+    pthread_mutex_unlock(&coalesce_lock);
+    pthread_cond_destroy(&w.cv);
+
+    if (w.superseded)
+        return coalesce_ack(t);
+    return coalesce_write(t, s);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "task.h"
+
+// How superseded PUTs are ordered
+typedef enum { COALESCE_OFF, COALESCE_ARRIVAL, COALESCE_REQUEST_ID } coalesce_order_t;
+
+/** @brief Turns on last-writer-wins coalescing of PUTs to the same URI.
+ *
+ *  @param order COALESCE_ARRIVAL orders PUTs by when the server accepted
+ *         them, COALESCE_REQUEST_ID by their numeric Request-Id header.
+ */
+void coalesce_init(coalesce_order_t order);
+
+/** @brief Whether coalescing is on
+ */
+bool coalesce_enabled(void);
+
+/** @brief Runs a PUT through the coalescer.
+ *
+ *         The body is drained into a spool first. If no PUT to the URI is
+ *         being written, this one is written right away. Otherwise it
+ *         waits as the URI's pending write. When a newer PUT becomes
+ *         pending, the older pending one is answered 200 OK and audited
+ *         without ever touching the file: it is treated as written and then
+ *         immediately overwritten. Only the newest pending body is written
+ *         when the current write finishes.
+ *
+ *  @param t a parsed PUT task
+ *
+ *  @return the status code audited for it
+ */
+uint16_t coalesce_put(task_t *t);
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include "deadline.h"
+#include "asgn2_helper_funcs.h"
+#include "httpserver.h"
+#include "wheel.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Timer resolution
+#define DEADLINE_TICK_MS 10
+
+static const char *deadline_names[DEADLINE_KINDS] = { "none", "idle", "header", "body", "write" };
+
+static bool enabled;
+// Limit per phase in ms, 0 if off
+static uint64_t limits[DEADLINE_KINDS];
+// Requests that hit each deadline
+static uint64_t counts[DEADLINE_KINDS];
+
+static __thread task_t *current;
+
+int deadline_configure(char *spec) {
+    char *const tokens[] = { "idle", "header", "body", "write", NULL };
+    char *value;
+    while (*spec) {
+        int i = getsubopt(&spec, tokens, &value);
+        if (i < 0 || !value)
+            return -1;
+        char *endptr = NULL;
+        long ms = strtol(value, &endptr, 10);
+        if (*endptr != '\0' || ms <= 0)
+            return -1;
+        limits[DEADLINE_IDLE + i] = ms;
+    }
+    enabled = true;
+    wheel_init(DEADLINE_TICK_MS);
+    return 0;
+}
+
+bool deadline_enabled(void) {
+    return enabled;
+}
+
+void deadline_bind(task_t *t) {
+    current = t;
+}
+
+/** @brief Runs on the wheel's thread when a phase's limit passes. Shutting down the read
+ *         side wakes a worker blocked in the helper library's reads; a stalled write
+ *         needs the whole socket shut down.
+ */
+static void deadline_fire(wheel_timer_t *timer) {
+    task_t *t = (task_t *) ((char *) timer - offsetof(task_t, timer));
+    __atomic_store_n(&t->timed_out, t->deadline, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&counts[t->deadline], 1, __ATOMIC_RELAXED);
+    shutdown(t->connfd, t->deadline == DEADLINE_WRITE ? SHUT_RDWR : SHUT_RD);
+}
+
+void deadline_start(task_t *t, deadline_kind_t kind) {
+    if (!enabled)
+        return;
+    // Cancel first, so a firing timer never sees the new phase
+    wheel_cancel(&t->timer);
+    if (!limits[kind])
+        return;
+    t->deadline = kind;
+    wheel_arm(&t->timer, limits[kind], deadline_fire);
+}
+
+void deadline_stop(task_t *t) {
+    if (enabled)
+        wheel_cancel(&t->timer);
+}
+
+void deadline_touch(void) {
+    if (current)
+        deadline_start(current, DEADLINE_WRITE);
+}
+
+bool deadline_answer(task_t *t) {
+    deadline_kind_t kind = __atomic_load_n(&t->timed_out, __ATOMIC_ACQUIRE);
+    if (kind != DEADLINE_IDLE && kind != DEADLINE_HEADER && kind != DEADLINE_BODY)
+        return false;
+    if (t->timeout_answered)
+        return true;
+    t->timeout_answered = true;
+    if (kind != DEADLINE_IDLE)
+        send_status(t->connfd, 408, "Request Timeout");
+    shutdown(t->connfd, SHUT_WR);
+    return true;
+}
+
+uint16_t deadline_audit_code(uint16_t code) {
+    if (!current)
+        return code;
+    deadline_kind_t kind = __atomic_load_n(&current->timed_out, __ATOMIC_ACQUIRE);
+    return kind == DEADLINE_IDLE || kind == DEADLINE_HEADER || kind == DEADLINE_BODY ? 408 : code;
+}
+
+bool deadline_serve(task_t *t) {
+    if (!enabled || strcmp(conn_get_uri(t->conn), DEADLINE_STATS_URI))
+        return false;
+
+    char body[256];
+    int body_len = 0;
+    for (int k = DEADLINE_IDLE; k < DEADLINE_KINDS; k++) {
+        body_len += snprintf(body + body_len, sizeof(body) - body_len, "%s %lu %lu\n",
+            deadline_names[k], (unsigned long) limits[k],
+            (unsigned long) __atomic_load_n(&counts[k], __ATOMIC_RELAXED));
+    }
+    uint16_t code = 200;
+    if (send_ok_header(t->connfd, body_len) || write_all(t->connfd, body, body_len) != body_len)
+        code = 500;
+    write_to_audit_code(t->conn, "GET", DEADLINE_STATS_URI, code);
+    return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "task.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timeouts page served at GET /.timeouts when deadlines are on
+#define DEADLINE_STATS_URI ".timeouts"
+
+/** @brief Turns on per-request deadlines.
+ *
+ *  @param spec comma-separated limits in milliseconds, any of
+ *         idle=ms    accept until the client's first byte (connection closed)
+ *         header=ms  first byte until the whole request head (408)
+ *         body=ms    reading the whole request body (408)
+ *         write=ms   a response making no progress (connection closed)
+ *         Limits that are left out are off. spec is modified.
+ *
+ *  @return 0 on success, -1 if spec is malformed
+ */
+int deadline_configure(char *spec);
+
+/** @brief Whether any deadline is on
+ */
+bool deadline_enabled(void);
+
+/** @brief Makes t the request this thread is working on, so the write deadline and
+ *         audit lines find it without it being passed around
+ */
+void deadline_bind(task_t *t);
+
+/** @brief Arms t's deadline for a phase, replacing whatever was armed
+ */
+void deadline_start(task_t *t, deadline_kind_t kind);
+
+/** @brief Disarms t's deadline. Must be called before its socket is closed.
+ */
+void deadline_stop(task_t *t);
+
+/** @brief Restarts the current request's write deadline; call before and while sending
+ */
+void deadline_touch(void);
+
+/** @brief Answers a request whose idle, header or body deadline passed: a 408 for the
+ *         latter two, nothing for idle. The write side is then shut down so the handler's
+ *         own error response goes nowhere. Only the first call sends anything.
+ *
+ *  @return true if t timed out and has been answered
+ */
+bool deadline_answer(task_t *t);
+
+/** @brief The status to audit for the current request: 408 if it timed out waiting for
+ *         its first byte or reading its head or body, otherwise code
+ */
+uint16_t deadline_audit_code(uint16_t code);
+
+/** @brief Serves GET /.timeouts: how many requests hit each deadline
+ *
+ *  @return false if the request is not for it
+ */
+bool deadline_serve(task_t *t);
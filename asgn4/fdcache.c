@@ -0,0 +1,406 @@
+#include "fdcache.h"
+#include "httpserver.h"
+#include "layout.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FDCACHE_BUCKETS 256
+// Directory changes that can make a cached fd stale
+#define FDCACHE_EVENTS                                                                             \
+    (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF)
+
+typedef struct fdc_entry {
+    char uri[64];
+    int fd;
+    // Requests holding a reference (under fdcache_lock)
+    int refs;
+    // Requests holding the shared flock through fd (under lock)
+    int users;
+    pthread_mutex_t lock;
+    // Still reachable from the table; otherwise it dies with its last reference
+    bool cached;
+    struct fdc_entry *hnext;
+    struct fdc_entry *prev, *next;
+} fdc_entry_t;
+
+static size_t fdcache_capacity;
+static int fdcache_ifd = -1;
+static size_t fdcache_count;
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static fdc_entry_t *buckets[FDCACHE_BUCKETS];
+// Most recently used at the head
+static fdc_entry_t *lru_head, *lru_tail;
+// Writers waiting for their exclusive lock, and the signal that one of them got it
+static fdcache_writer_t *writers[FDCACHE_BUCKETS];
+static pthread_cond_t writer_done = PTHREAD_COND_INITIALIZER;
+
+/** @brief Hashes a URI to its bucket
+ */
+static size_t fdcache_bucket(const char *uri) {
+    size_t h = 5381;
+    for (; *uri; uri++)
+        h = h * 33 + (unsigned char) *uri;
+    return h % FDCACHE_BUCKETS;
+}
+
+/** @brief Closes and frees an entry. No one may reference it.
+ */
+static void fdcache_free(fdc_entry_t *e) {
+    close(e->fd);
+    pthread_mutex_destroy(&e->lock);
+    free(e);
+}
+
+/** @brief Unlinks an entry from the table and LRU list. Must hold fdcache_lock.
+ *
+ *  @return true if the caller should free it (no references left)
+ */
+static bool fdcache_unlink(fdc_entry_t *e) {
+    fdc_entry_t **pp = &buckets[fdcache_bucket(e->uri)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+    e->cached = false;
+    fdcache_count--;
+    return e->refs == 0;
+}
+
+/** @brief Moves an entry to the front of the LRU list. Must hold fdcache_lock.
+ */
+static void fdcache_touch(fdc_entry_t *e) {
+    if (lru_head == e)
+        return;
+    e->prev->next = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+    e->prev = NULL;
+    e->next = lru_head;
+    lru_head->prev = e;
+    lru_head = e;
+}
+
+/** @brief Finds a cached entry. Must hold fdcache_lock.
+ */
+static fdc_entry_t *fdcache_find(const char *uri) {
+    fdc_entry_t *e = buckets[fdcache_bucket(uri)];
+    while (e && strcmp(e->uri, uri))
+        e = e->hnext;
+    return e;
+}
+
+/** @brief Whether a writer is waiting for uri. Must hold fdcache_lock.
+ */
+static bool fdcache_writer_waiting(const char *uri) {
+    fdcache_writer_t *w = writers[fdcache_bucket(uri)];
+    while (w && strcmp(w->uri, uri))
+        w = w->next;
+    return w != NULL;
+}
+
+/** @brief Announces a writer waiting for LOCK_EX on uri (see fdcache.h)
+ */
+void fdcache_write_begin(const char *uri, fdcache_writer_t *w) {
+    w->uri = NULL;
+    if (!__atomic_load_n(&fdcache_capacity, __ATOMIC_ACQUIRE))
+        return;
+    size_t b = fdcache_bucket(uri);
+    pthread_mutex_lock(&fdcache_lock);
+    w->uri = uri;
+    w->next = writers[b];
+    writers[b] = w;
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+/** @brief Lets GETs through again once the writer has its lock
+ */
+void fdcache_write_end(fdcache_writer_t *w) {
+    if (!w->uri)
+        return;
+    pthread_mutex_lock(&fdcache_lock);
+    fdcache_writer_t **pp = &writers[fdcache_bucket(w->uri)];
+    while (*pp != w)
+        pp = &(*pp)->next;
+    *pp = w->next;
+    pthread_cond_broadcast(&writer_done);
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+/** @brief Forgets the cached fd for uri
+ */
+void fdcache_invalidate(const char *uri) {
+    if (!fdcache_capacity)
+        return;
+    pthread_mutex_lock(&fdcache_lock);
+    fdc_entry_t *e = fdcache_find(uri);
+    bool dead = e && fdcache_unlink(e);
+    pthread_mutex_unlock(&fdcache_lock);
+    if (dead)
+        fdcache_free(e);
+}
+
+/** @brief Forgets every cached fd (inotify queue overflow)
+ */
+static void fdcache_invalidate_all(void) {
+    pthread_mutex_lock(&fdcache_lock);
+    while (lru_head) {
+        fdc_entry_t *e = lru_head;
+        if (fdcache_unlink(e))
+            fdcache_free(e);
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+/** @brief Evicts changes made to the directory behind our back
+ */
+static void *fdcache_watch(void *arg) {
+    int ifd = (int) (intptr_t) arg;
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(ifd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW)
+                fdcache_invalidate_all();
+            else if (ev->len)
+                fdcache_invalidate(ev->name);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    // Without notifications the cache can't be trusted any more
+    fdcache_invalidate_all();
+    __atomic_store_n(&fdcache_capacity, 0, __ATOMIC_RELEASE);
+    close(ifd);
+    return NULL;
+}
+
+/** @brief Turns on the open file cache
+ *
+ *  @return the capacity actually used
+ */
+size_t fdcache_init(size_t capacity) {
+    struct rlimit rl;
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY
+        && capacity > rl.rlim_cur / 2)
+        capacity = rl.rlim_cur / 2;
+    if (!capacity)
+        return 0;
+
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0 || inotify_add_watch(ifd, ".", FDCACHE_EVENTS) < 0) {
+        if (ifd >= 0)
+            close(ifd);
+        return 0;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, fdcache_watch, (void *) (intptr_t) ifd)) {
+        close(ifd);
+        return 0;
+    }
+    pthread_detach(tid);
+    fdcache_ifd = ifd;
+    fdcache_capacity = capacity;
+    return capacity;
+}
+
+/** @brief Opens a fresh fd for uri, the same way handle_get always has
+ *
+ *  @return the fd, or -1 with *res set
+ */
+static int fdcache_open_fd(const char *uri, const Response_t **res) {
+    // Wait for any in-progress creation
+    pthread_mutex_lock(&file_creation_lock);
+    pthread_mutex_unlock(&file_creation_lock);
+
+    int fd = layout_open(uri, O_RDONLY, 0);
+    if (fd < 0) {
+        *res = errno == EACCES   ? &RESPONSE_FORBIDDEN
+               : errno == ENOENT ? &RESPONSE_NOT_FOUND
+                                 : &RESPONSE_INTERNAL_SERVER_ERROR;
+    }
+    return fd;
+}
+
+/** @brief Takes the shared lock and refreshes the metadata of an acquired ref
+ */
+static const Response_t *fdcache_lock_ref(fd_ref_t *ref) {
+    fdc_entry_t *e = ref->entry;
+    int ret;
+    if (e) {
+        pthread_mutex_lock(&e->lock);
+        ret = e->users++ ? 0 : flock(ref->fd, LOCK_SH);
+        if (ret)
+            e->users--;
+        pthread_mutex_unlock(&e->lock);
+    } else {
+        ret = flock(ref->fd, LOCK_SH);
+    }
+    if (ret)
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+    if (fstat(ref->fd, &ref->st))
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+    if (S_ISDIR(ref->st.st_mode))
+        return &RESPONSE_FORBIDDEN;
+    return NULL;
+}
+
+/** @brief Opens uri for reading under a shared flock
+ *
+ *  @return NULL on success, otherwise the response to send
+ */
+const Response_t *fdcache_open(const char *uri, fd_ref_t *ref) {
+    const Response_t *res = NULL;
+    memset(ref, 0, sizeof(*ref));
+    ref->fd = -1;
+
+    if (!__atomic_load_n(&fdcache_capacity, __ATOMIC_ACQUIRE) || strlen(uri) >= 64) {
+        ref->fd = fdcache_open_fd(uri, &res);
+        if (ref->fd < 0)
+            return res;
+        goto lock;
+    }
+
+    pthread_mutex_lock(&fdcache_lock);
+    // Let a waiting writer in first: new readers would keep the shared lock held
+    if (fdcache_writer_waiting(uri)) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += FDCACHE_DEFER_MS / 1000;
+        until.tv_nsec += (FDCACHE_DEFER_MS % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (fdcache_writer_waiting(uri)
+               && pthread_cond_timedwait(&writer_done, &fdcache_lock, &until) != ETIMEDOUT)
+            ;
+    }
+    fdc_entry_t *e = fdcache_find(uri);
+    if (e) {
+        e->refs++;
+        fdcache_touch(e);
+        pthread_mutex_unlock(&fdcache_lock);
+    } else {
+        // Miss: open without holding the table lock
+        pthread_mutex_unlock(&fdcache_lock);
+        // Hashed objects live in subdirectories, which need their own watch (events there
+        // still name the object). Watch before opening, so no change can slip in between.
+        // Without a watch (e.g. fs.inotify.max_user_watches ran out) renames and deletes made
+        // outside the server would go unnoticed, so the object is served uncached.
+        char dir[LAYOUT_PATH_MAX];
+        if (layout_hashed()
+            && inotify_add_watch(fdcache_ifd, layout_dir(uri, dir), FDCACHE_EVENTS) < 0) {
+            ref->fd = fdcache_open_fd(uri, &res);
+            if (ref->fd < 0)
+                return res;
+            goto lock;
+        }
+        int fd = fdcache_open_fd(uri, &res);
+        if (fd < 0)
+            return res;
+
+        pthread_mutex_lock(&fdcache_lock);
+        e = fdcache_find(uri);
+        if (e) {
+            // Lost a race with another miss; use theirs
+            e->refs++;
+            fdcache_touch(e);
+            pthread_mutex_unlock(&fdcache_lock);
+            close(fd);
+        } else {
+            e = calloc(1, sizeof(fdc_entry_t));
+            if (!e) {
+                pthread_mutex_unlock(&fdcache_lock);
+                close(fd);
+                return &RESPONSE_INTERNAL_SERVER_ERROR;
+            }
+            snprintf(e->uri, sizeof(e->uri), "%s", uri);
+            e->fd = fd;
+            e->refs = 1;
+            e->cached = true;
+            pthread_mutex_init(&e->lock, NULL);
+            size_t b = fdcache_bucket(uri);
+            e->hnext = buckets[b];
+            buckets[b] = e;
+            e->next = lru_head;
+            if (lru_head)
+                lru_head->prev = e;
+            lru_head = e;
+            if (!lru_tail)
+                lru_tail = e;
+            fdcache_count++;
+
+            // Evict from the cold end; entries in use are freed by their last user
+            fdc_entry_t *victim = NULL;
+            if (fdcache_count > fdcache_capacity) {
+                victim = lru_tail;
+                if (!fdcache_unlink(victim))
+                    victim = NULL;
+            }
+            pthread_mutex_unlock(&fdcache_lock);
+            if (victim)
+                fdcache_free(victim);
+        }
+    }
+    ref->entry = e;
+    ref->fd = e->fd;
+
+lock:
+    res = fdcache_lock_ref(ref);
+    if (res)
+        fdcache_close(ref);
+    return res;
+}
+
+/** @brief Drops the shared lock and releases ref
+ */
+void fdcache_close(fd_ref_t *ref) {
+    fdc_entry_t *e = ref->entry;
+    if (!e) {
+        if (ref->fd >= 0)
+            close(ref->fd);
+        ref->fd = -1;
+        return;
+    }
+
+    // Only the last holder may drop the lock, since it belongs to the shared open file
+    pthread_mutex_lock(&e->lock);
+    if (e->users > 0 && --e->users == 0)
+        flock(e->fd, LOCK_UN);
+    pthread_mutex_unlock(&e->lock);
+
+    pthread_mutex_lock(&fdcache_lock);
+    bool dead = --e->refs == 0 && !e->cached;
+    pthread_mutex_unlock(&fdcache_lock);
+    if (dead)
+        fdcache_free(e);
+    ref->entry = NULL;
+    ref->fd = -1;
+}
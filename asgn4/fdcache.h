@@ -0,0 +1,81 @@
+#pragma once
+
+#include "response.h"
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+// Longest a GET defers to a waiting writer. Bounded, so requests that hold several URIs at
+// once (batch reads) can't deadlock with writers of those URIs.
+#define FDCACHE_DEFER_MS 1000
+
+/** @struct fd_ref_t
+ *
+ *  @brief An open, shared-locked resource handed out by fdcache_open. The
+ *         fd may be shared with other requests, so it must only be read
+ *         with explicit offsets (pread/sendfile), never read/lseek.
+ */
+typedef struct {
+    int fd;
+    struct stat st;
+    void *entry;
+} fd_ref_t;
+
+/** @struct fdcache_writer_t
+ *
+ *  @brief A write waiting for its exclusive lock on uri (see fdcache_write_begin).
+ *         Lives on the writer's stack.
+ */
+typedef struct fdcache_writer {
+    const char *uri;
+    struct fdcache_writer *next;
+} fdcache_writer_t;
+
+/** @brief Turns on the open file cache with room for up to capacity fds,
+ *         clamped so it never uses more than half of RLIMIT_NOFILE.
+ *         Watches the working directory with inotify so renames, deletes,
+ *         creates and permission changes made outside this server evict the
+ *         affected entries. Without this call fdcache_open simply opens.
+ *
+ *  @param capacity maximum number of cached fds
+ *
+ *  @return the capacity actually used
+ */
+size_t fdcache_init(size_t capacity);
+
+/** @brief Opens uri for reading and takes a shared flock on it, reusing a
+ *         cached fd when there is one. ref->st is always fresh (fstat under
+ *         the lock), so in-place rewrites of the same inode are seen.
+ *
+ *  @param uri the resource
+ *
+ *  @param ref filled in on success
+ *
+ *  @return NULL on success, otherwise the response to send (403 for
+ *          directories and EACCES, 404, or 500)
+ */
+const Response_t *fdcache_open(const char *uri, fd_ref_t *ref);
+
+/** @brief Drops the shared lock (once no one else holds it through the same
+ *         fd) and releases ref
+ */
+void fdcache_close(fd_ref_t *ref);
+
+/** @brief Forgets the cached fd for uri, e.g. after a write through this
+ *         server. Requests already holding it are unaffected.
+ */
+void fdcache_invalidate(const char *uri);
+
+/** @brief Announces a writer about to wait for LOCK_EX on uri. A cached fd's shared lock is
+ *         held for as long as any request uses it, so an overlapping stream of GETs would
+ *         never let it go. Until fdcache_write_end, GETs for uri wait (up to
+ *         FDCACHE_DEFER_MS) before taking their shared lock, so the current readers drain
+ *         and the writer gets in. Does nothing while the cache is off.
+ *
+ *  @param w filled in and linked in; must stay valid until fdcache_write_end
+ */
+void fdcache_write_begin(const char *uri, fdcache_writer_t *w);
+
+/** @brief The writer announced with w has its lock (or gave up); lets GETs through again
+ */
+void fdcache_write_end(fdcache_writer_t *w);
@@ -0,0 +1,162 @@
+#include "flight.h"
+#include "asgn2_helper_funcs.h"
+#include "fdcache.h"
+#include "httpserver.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FLIGHT_BUCKETS 64
+
+typedef struct flight {
+    char uri[64];
+    bool done;
+    // Number of requests (leader included) still using data
+    int refs;
+    // NULL when the object couldn't be shared
+    const Response_t *res;
+    char *data;
+    size_t size;
+    struct flight *next;
+} flight_t;
+
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_done = PTHREAD_COND_INITIALIZER;
+static flight_t *flights[FLIGHT_BUCKETS];
+static bool flight_on;
+
+void flight_init(void) {
+    flight_on = true;
+}
+
+/** @brief Whether single-flight GETs are on
+ */
+bool flight_enabled(void) {
+    return flight_on;
+}
+
+/** @brief Hashes a URI to its bucket
+ */
+static size_t flight_bucket(const char *uri) {
+    size_t h = 5381;
+    for (; *uri; uri++)
+        h = h * 33 + (unsigned char) *uri;
+    return h % FLIGHT_BUCKETS;
+}
+
+/** @brief Leader: reads the object under a shared lock
+ *
+ *  @param ref receives the resource, still locked, so the caller decides when the lock drops
+ */
+static void flight_read(flight_t *f, fd_ref_t *ref) {
+    f->res = fdcache_open(f->uri, ref);
+    if (f->res)
+        return;
+    if (!S_ISREG(ref->st.st_mode) || ref->st.st_size > FLIGHT_MAX) {
+        f->res = NULL;
+        return;
+    }
+    f->size = ref->st.st_size;
+    f->data = malloc(f->size ? f->size : 1);
+    if (!f->data) {
+        f->res = &RESPONSE_INTERNAL_SERVER_ERROR;
+        f->size = 0;
+        return;
+    }
+    for (size_t off = 0; off < f->size;) {
+        ssize_t n = pread(ref->fd, f->data + off, f->size - off, off);
+        if (n <= 0) {
+            f->res = &RESPONSE_INTERNAL_SERVER_ERROR;
+            f->size = 0;
+            break;
+        }
+        off += n;
+    }
+    if (!f->res)
+        f->res = &RESPONSE_OK;
+}
+
+/** @brief Sends a flight's result to one requester and audits it
+ */
+static void flight_send(task_t *t, const flight_t *f) {
+    write_to_audit(t->conn, f->res);
+    if (f->res != &RESPONSE_OK) {
+        conn_send_response(t->conn, f->res);
+        return;
+    }
+    if (!send_ok_header(t->connfd, f->size) && f->size)
+        write_all(t->connfd, f->data, f->size);
+}
+
+/** @brief Drops a reference, freeing the flight with the last one
+ */
+static void flight_put(flight_t *f) {
+    pthread_mutex_lock(&flight_lock);
+    bool last = --f->refs == 0;
+    pthread_mutex_unlock(&flight_lock);
+    if (last) {
+        free(f->data);
+        free(f);
+    }
+}
+
+/** @brief Serves a GET through single-flight coalescing (see flight.h)
+ *
+ *  @return true if answered, false if the caller should serve it itself
+ */
+bool flight_serve(task_t *t) {
+    const char *uri = conn_get_uri(t->conn);
+    size_t b = flight_bucket(uri);
+
+    pthread_mutex_lock(&flight_lock);
+    flight_t *f = flights[b];
+    while (f && strcmp(f->uri, uri))
+        f = f->next;
+
+    if (f) {
+        // Follower: wait for the leader's read
+        f->refs++;
+        while (!f->done)
+            pthread_cond_wait(&flight_done, &flight_lock);
+        pthread_mutex_unlock(&flight_lock);
+    } else {
+        // Leader: publish the flight, read without holding flight_lock, then retire it
+        f = calloc(1, sizeof(flight_t));
+        if (!f) {
+            pthread_mutex_unlock(&flight_lock);
+            write_to_audit(t->conn, &RESPONSE_INTERNAL_SERVER_ERROR);
+            conn_send_response(t->conn, &RESPONSE_INTERNAL_SERVER_ERROR);
+            return true;
+        }
+        snprintf(f->uri, sizeof(f->uri), "%s", uri);
+        f->refs = 1;
+        f->next = flights[b];
+        flights[b] = f;
+        pthread_mutex_unlock(&flight_lock);
+
+        fd_ref_t ref;
+        flight_read(f, &ref);
+
+        // Retire the flight before dropping the flock, so a GET that arrives after a PUT
+        // has finished can never attach to a read of the older contents
+        pthread_mutex_lock(&flight_lock);
+        flight_t **pp = &flights[b];
+        while (*pp != f)
+            pp = &(*pp)->next;
+        *pp = f->next;
+        f->done = true;
+        pthread_cond_broadcast(&flight_done);
+        pthread_mutex_unlock(&flight_lock);
+        fdcache_close(&ref);
+    }
+
+    bool served = f->res != NULL;
+    if (served)
+        flight_send(t, f);
+    flight_put(f);
+    return served;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "task.h"
+
+#include <stdbool.h>
+
+// Objects up to this size are read once and fanned out to every concurrent
+// GET for the same URI; larger ones are streamed per request as before.
+#define FLIGHT_MAX (1024 * 1024)
+
+/** @brief Turns on single-flight GETs. Off by default, since a GET that has nobody to share
+ *         with pays for a copy through memory instead of a zero-copy send.
+ */
+void flight_init(void);
+
+/** @brief Whether single-flight GETs are on
+ */
+bool flight_enabled(void);
+
+/** @brief Serves a GET through single-flight coalescing.
+ *
+ *         The first GET for a URI becomes the leader: it opens, locks and
+ *         reads the object into memory under a shared flock. GETs for the
+ *         same URI that arrive while that read is in flight attach to it
+ *         and wait. When the read finishes, every attached request sends
+ *         the same bytes (or the same error) to its own socket and writes
+ *         its own audit line. Requests arriving after the read finishes
+ *         start a new flight, so nobody is served a version older than the
+ *         one on disk when they arrived. If memory for the flight or the
+ *         object can't be allocated, the request is answered 500.
+ *
+ *  @param t a parsed GET task
+ *
+ *  @return true if the request was answered, false if the object is too
+ *          large (or not a regular file) to share and the caller should
+ *          serve it the normal way
+ */
+bool flight_serve(task_t *t);
@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include "head.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// How long we wait for more of the head before giving up, the same budget listener_accept
+// gives a blocking read. A header deadline (-T header=ms) shuts the read side down sooner,
+// which ends the wait too.
+#define HEAD_STALL_MS 5000
+
+/** @brief Peeks (MSG_PEEK) at the socket until the full request head,
+ *         terminated by "\r\n\r\n", is available. Nothing is consumed.
+ *
+ *  @return 0 on success, -1 otherwise
+ */
+int head_peek(int connfd, head_t *head) {
+    head->len = 0;
+    head->buf[0] = '\0';
+
+    int ep = -1;
+    int ret = -1;
+    // The peer shut down its side; whatever it sent is already there
+    bool hup = false;
+    while (1) {
+        ssize_t n = recv(connfd, head->buf, HEAD_MAX, MSG_PEEK);
+        if (n <= 0)
+            break;
+        char *end = memmem(head->buf, n, "\r\n\r\n", 4);
+        if (end) {
+            head->len = end - head->buf + 4;
+            head->buf[head->len] = '\0';
+            ret = 0;
+            break;
+        }
+        if (n >= HEAD_MAX || hup)
+            break;
+
+        // Wait for more bytes. poll() reports the unread bytes already there as readable, and
+        // AF_UNIX ignores MSG_WAITALL with MSG_PEEK, so wait on an edge-triggered epoll for
+        // the next arrival instead. It also wakes up when the read side is shut down (by the
+        // client or a deadline). Most heads arrive whole, so it is only set up here.
+        if (ep < 0) {
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET };
+            ep = epoll_create1(EPOLL_CLOEXEC);
+            if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, connfd, &ev))
+                break;
+            // Bytes that arrived before the registration count as one edge; peek again
+            continue;
+        }
+        struct epoll_event ev;
+        int ready = epoll_wait(ep, &ev, 1, HEAD_STALL_MS);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0 || (ev.events & EPOLLERR))
+            break;
+        // The rest of the head often comes in the same edge as the FIN (e.g. a client that
+        // sends the head and then shuts down its write side), so peek once more
+        hup = ev.events & (EPOLLRDHUP | EPOLLHUP);
+    }
+    if (ep >= 0)
+        close(ep);
+    return ret;
+}
+
+/** @brief Checks the request method
+ *
+ *  @return true if the request line starts with method followed by a space
+ */
+bool head_is_method(const head_t *head, const char *method) {
+    size_t n = strlen(method);
+    return head->len > n && !strncmp(head->buf, method, n) && head->buf[n] == ' ';
+}
+
+/** @brief Looks up a header field (case-insensitive)
+ *
+ *  @return true if the header was present and fit in out
+ */
+bool head_get(const head_t *head, const char *name, char *out, size_t outsize) {
+    if (!head->len)
+        return false;
+    size_t nlen = strlen(name);
+    // Skip the request line
+    const char *line = strstr(head->buf, "\r\n");
+    while (line) {
+        line += 2;
+        const char *eol = strstr(line, "\r\n");
+        if (!eol || eol == line)
+            return false;
+        if ((size_t) (eol - line) > nlen && !strncasecmp(line, name, nlen) && line[nlen] == ':') {
+            const char *val = line + nlen + 1;
+            while (val < eol && *val == ' ')
+                val++;
+            size_t vlen = eol - val;
+            if (vlen >= outsize)
+                return false;
+            memcpy(out, val, vlen);
+            out[vlen] = '\0';
+            return true;
+        }
+        line = eol;
+    }
+    return false;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Largest request line + header block we are willing to look at. Matches
+// the limit enforced by conn_parse.
+#define HEAD_MAX 2048
+
+/** @struct head_t
+ *
+ *  @brief A non-destructive copy of a request's request line and header
+ *         fields. The helper library only exposes GET/PUT and a couple of
+ *         headers, so this lets us look at the rest without stealing bytes
+ *         from conn_parse.
+ */
+typedef struct {
+    char buf[HEAD_MAX + 1];
+    size_t len;
+} head_t;
+
+/** @brief Peeks (MSG_PEEK) at the socket until the full request head,
+ *         terminated by "\r\n\r\n", is available. Nothing is consumed.
+ *
+ *  @param connfd the client socket
+ *
+ *  @param head the head_t to fill in
+ *
+ *  @return 0 on success, -1 if the head was too large, timed out or the
+ *          client went away. head->len is 0 on failure.
+ */
+int head_peek(int connfd, head_t *head);
+
+/** @brief Checks the request method
+ *
+ *  @return true if the request line starts with method followed by a space
+ */
+bool head_is_method(const head_t *head, const char *method);
+
+/** @brief Looks up a header field (case-insensitive)
+ *
+ *  @param head a peeked request head
+ *
+ *  @param name the header field name, e.g. "Content-Range"
+ *
+ *  @param out buffer that receives the NUL-terminated value
+ *
+ *  @param outsize size of out
+ *
+ *  @return true if the header was present and fit in out
+ */
+bool head_get(const head_t *head, const char *name, char *out, size_t outsize);
@@ -3,17 +3,37 @@
 //     Andrew Quinn
 //     Brian Zhao
 
+#define _GNU_SOURCE
+#include "alloc.h"
 #include "asgn2_helper_funcs.h"
+#include "batch.h"
+#include "bigput.h"
+#include "coalesce.h"
 #include "connection.h"
+#include "deadline.h"
+#include "fdcache.h"
+#include "flight.h"
+#include "head.h"
 #include "httpserver.h"
+#include "idem.h"
+#include "layout.h"
+#include "profile.h"
 #include "response.h"
 #include "request.h"
 #include "queue.h"
+#include "repl.h"
+#include "stage.h"
+#include "task.h"
+#include "uds.h"
+#include "warmup.h"
 
 #include <err.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/statvfs.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -30,217 +50,640 @@ queue_t *conn_queue;
 // Global file_creation lock
 pthread_mutex_t file_creation_lock = PTHREAD_MUTEX_INITIALIZER;
 
+#define USAGE                                                                                      \
+    "usage: %s [-t threads] [-n net_threads] [-s spool_dir] [-u socket_path [-m mode]] "           \
+    "[-w audit_log [-b warm_mb]] [-c arrival|request-id] [-f fd_cache_size] "                      \
+    "[-D direct_io_bytes] [-S] [-L change_log | -F primary_port] [-I idempotency_ttl_s] "          \
+    "[-T idle=ms,header=ms,body=ms,write=ms] [--profile[=hz] [--profile-out=path]] [-H] "          \
+    "[port]\n"                                                                                     \
+    "       %s --migrate-layout\n"
+
+// Default page cache warm-up budget (-b), in MB
+#define WARMUP_DEFAULT_MB 256
+
+// Long options, which have no short form
+enum { OPT_PROFILE = 256, OPT_PROFILE_OUT, OPT_MIGRATE_LAYOUT };
+static const struct option long_options[] = {
+    { "profile", optional_argument, NULL, OPT_PROFILE },
+    { "profile-out", required_argument, NULL, OPT_PROFILE_OUT },
+    { "migrate-layout", no_argument, NULL, OPT_MIGRATE_LAYOUT },
+    { NULL, 0, NULL, 0 },
+};
+
+/** @brief Parses a positive integer option argument
+ *
+ *  @return the value, or -1 if it is not a positive integer
+ */
+static long parse_count(const char *arg) {
+    char *endptr = NULL;
+    long val = strtol(arg, &endptr, 10);
+    if ((endptr && *endptr != '\0') || val <= 0)
+        return -1;
+    return val;
+}
+
+/** @brief Accepts connections on one listener forever, feeding the shared connection queue.
+ *         Each connection is numbered here, so its place in arrival order doesn't depend on
+ *         when a worker gets to it.
+ */
+static void *accept_loop(void *arg) {
+    Listener_Socket *sock = arg;
+    // Shared by every listener
+    static uint64_t accept_seq;
+    while (1) {
+        int connfd = listener_accept(sock);
+        // Don't queue the connection if it was bad nor print anything to audit log (not expected)
+        if (connfd < 0)
+            continue;
+        accepted_t *a = malloc(sizeof(accepted_t));
+        if (!a) {
+            close(connfd);
+            continue;
+        }
+        a->connfd = connfd;
+        a->seq = __atomic_add_fetch(&accept_seq, 1, __ATOMIC_RELAXED);
+        queue_push(conn_queue, a);
+    }
+    return NULL;
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2 || argc == 3 || argc >= 5) {
+    if (argc < 2) {
         warnx("wrong arguments: %s [-t threads] port_num", argv[0]);
-        fprintf(stderr, "usage: %s [-t threads] <port>\n", argv[0]);
+        fprintf(stderr, USAGE, argv[0], argv[0]);
         return EXIT_FAILURE;
     }
 
-    char *endptr = NULL;
-    size_t port = (size_t) strtoull(argv[argc - 1], &endptr, 10);
-    if (endptr && *endptr != '\0') {
-        warnx("invalid port number: %s", argv[argc - 1]);
-        return EXIT_FAILURE;
-    }
     // Parse command line args
     int c;
+    char *endptr = NULL;
     long threads = 4;
+    long net_threads = 0;
+    const char *spool_dir = P_tmpdir;
+    const char *uds_path = NULL;
+    mode_t uds_mode = 0660;
+    const char *warm_log = NULL;
+    long warm_mb = WARMUP_DEFAULT_MB;
+    long fd_cache = 0;
+    long direct_bytes = 0;
+    const char *change_log = NULL;
+    long primary_port = 0;
+    char *timeouts = NULL;
+    bool hashed_layout = false;
+    bool migrate_layout = false;
+    long profile_hz = 0;
+    char profile_out[64];
+    snprintf(profile_out, sizeof(profile_out), "%s/httpserver.%d.folded", P_tmpdir, getpid());
+    const char *profile_path = profile_out;
     opterr = 0;
-    while ((c = getopt(argc, argv, ":t:")) != -1) {
+    while ((c = getopt_long(argc, argv, ":t:n:s:u:m:w:b:c:f:D:SL:F:T:I:H", long_options, NULL))
+           != -1) {
         switch (c) {
         case 't':
-            endptr = NULL;
-            threads = strtol(optarg, &endptr, 10);
-            if ((endptr && *endptr != '\0') || threads <= 0) {
+            threads = parse_count(optarg);
+            if (threads <= 0) {
                 warnx("invalid number of worker threads: %s", optarg);
                 return EXIT_FAILURE;
             }
             break;
-        default: fprintf(stderr, "usage: %s [-t threads] <port>\n", argv[0]); return EXIT_FAILURE;
+        case 'n':
+            net_threads = parse_count(optarg);
+            if (net_threads <= 0) {
+                warnx("invalid number of network threads: %s", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's': spool_dir = optarg; break;
+        case 'u': uds_path = optarg; break;
+        case 'm':
+            endptr = NULL;
+            uds_mode = strtol(optarg, &endptr, 8);
+            if ((endptr && *endptr != '\0') || uds_mode > 0777) {
+                warnx("invalid socket mode: %s", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'w': warm_log = optarg; break;
+        case 'b':
+            warm_mb = parse_count(optarg);
+            if (warm_mb <= 0) {
+                warnx("invalid warm-up budget: %s", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            if (!strcmp(optarg, "arrival")) {
+                coalesce_init(COALESCE_ARRIVAL);
+            } else if (!strcmp(optarg, "request-id")) {
+                coalesce_init(COALESCE_REQUEST_ID);
+            } else {
+                warnx("invalid coalescing order: %s", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            fd_cache = parse_count(optarg);
+            if (fd_cache <= 0) {
+                warnx("invalid fd cache size: %s", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D':
+            direct_bytes = parse_count(optarg);
+            if (direct_bytes <= 0) {
+                warnx("invalid O_DIRECT threshold: %s", optarg);
+                return EXIT_FAILURE;
+            }
+            bigput_set_direct_threshold(direct_bytes);
+            break;
+        case 'S': flight_init(); break;
+        case 'L': change_log = optarg; break;
+        case 'F':
+            primary_port = parse_count(optarg);
+            if (primary_port <= 0 || primary_port > 65535) {
+                warnx("invalid primary port: %s", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'T': timeouts = optarg; break;
+        case 'I': {
+            long ttl = parse_count(optarg);
+            if (ttl <= 0) {
+                warnx("invalid idempotency window: %s", optarg);
+                return EXIT_FAILURE;
+            }
+            idem_init(ttl);
+            break;
+        }
+        case OPT_PROFILE:
+            profile_hz = optarg ? parse_count(optarg) : PROFILE_DEFAULT_HZ;
+            if (profile_hz <= 0) {
+                warnx("invalid profiling rate: %s", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_PROFILE_OUT: profile_path = optarg; break;
+        case 'H': hashed_layout = true; break;
+        case OPT_MIGRATE_LAYOUT: migrate_layout = true; break;
+        default: fprintf(stderr, USAGE, argv[0], argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    // One-time conversion of a flat directory for -H; doesn't start the server
+    if (migrate_layout) {
+        if (optind != argc) {
+            fprintf(stderr, USAGE, argv[0], argv[0]);
+            return EXIT_FAILURE;
         }
+        int failed = layout_migrate();
+        if (failed < 0)
+            err(EXIT_FAILURE, "layout migration");
+        if (failed)
+            errx(EXIT_FAILURE, "layout migration: %d objects could not be moved", failed);
+        return EXIT_SUCCESS;
     }
 
-    if (optind >= argc) {
-        fprintf(stderr, "Expected a positive integer after option -t\n");
+    // TCP, a Unix domain socket, or both. A server is a primary or a follower, not both.
+    if (optind < argc - 1 || (optind == argc && !uds_path) || (change_log && primary_port)) {
+        fprintf(stderr, USAGE, argv[0], argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    // The profiler goes first: every thread must inherit its signal mask
+    if (profile_hz) {
+        if (profile_init(profile_hz, profile_path)) {
+            fprintf(stderr, "Failed to start the profiler: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (timeouts && deadline_configure(timeouts)) {
+        warnx("invalid timeouts: %s", timeouts);
+        return EXIT_FAILURE;
+    }
+
     signal(SIGPIPE, SIG_IGN);
-    Listener_Socket sock;
-    int ret = listener_init(&sock, port);
+    // A write past RLIMIT_FSIZE fails with EFBIG instead of killing the server
+    signal(SIGXFSZ, SIG_IGN);
+    Listener_Socket sock = { .fd = -1 };
+    if (optind == argc - 1) {
+        endptr = NULL;
+        size_t port = (size_t) strtoull(argv[optind], &endptr, 10);
+        if (endptr && *endptr != '\0') {
+            warnx("invalid port number: %s", argv[optind]);
+            return EXIT_FAILURE;
+        }
+        int ret = listener_init(&sock, port);
 
-    // Check the port value just in case
-    if (ret) {
-        fprintf(stderr, "Failed to listen on port %zu. Already in use\n", port);
+        // Check the port value just in case
+        if (ret) {
+            fprintf(stderr, "Failed to listen on port %zu. Already in use\n", port);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Listener_Socket uds_sock = { .fd = -1 };
+    if (uds_path && uds_listener_init(&uds_sock, uds_path, uds_mode)) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", uds_path, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    // Create queue & thread pool
-    conn_queue = queue_new(threads);
-    thread_pool_new(threads);
+    task_set_spool_dir(spool_dir);
+    if (layout_init(hashed_layout)) {
+        fprintf(stderr, "Failed to set up the hashed layout: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (change_log && repl_primary_init(change_log)) {
+        fprintf(stderr, "Failed to open change log %s: %s\n", change_log, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (primary_port)
+        repl_follower_init(primary_port);
+    if (fd_cache && !fdcache_init(fd_cache))
+        warnx("fd cache disabled: inotify unavailable or RLIMIT_NOFILE too low");
+
+    // Prefetch last run's hot objects in the background while we start accepting
+    if (warm_log && warmup_start(warm_log, (size_t) warm_mb << 20))
+        warnx("could not start warm-up from audit log %s, skipping it", warm_log);
+
+    // Create queue & thread pool, or the network + disk stages when -n is given
+    if (net_threads) {
+        conn_queue = queue_new(net_threads);
+        stage_init(conn_queue, net_threads, threads);
+    } else {
+        conn_queue = queue_new(threads);
+        thread_pool_new(threads);
+    }
 
-    while (1) {
-        int connfd = listener_accept(&sock);
-        queue_push(conn_queue, (void *) (intptr_t) connfd);
+    // Both listeners feed the same queue and workers
+    if (sock.fd >= 0 && uds_sock.fd >= 0) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, accept_loop, &uds_sock);
     }
+    accept_loop(sock.fd >= 0 ? &sock : &uds_sock);
 
     return EXIT_SUCCESS;
 }
 
 /** @brief Writes to audit log in stderr given a ptr to a conn_t struct and a pointer to a Response_t struct
  * 
+ *  @return the status code written, or 0 if nothing was
 */
-void write_to_audit(conn_t *conn, const Response_t *res) {
+uint16_t write_to_audit(conn_t *conn, const Response_t *res) {
     if (!conn || !res)
-        return;
-    char *header = conn_get_header(conn, "Request-Id");
+        return 0;
+    return write_to_audit_code(conn, request_get_str(conn_get_request(conn)), conn_get_uri(conn),
+        response_get_code(res));
+}
+
+/** @brief Writes an audit log line for a method/URI the helper library does not know about
+ *         (e.g. one item of a batch read)
+ *
+ *  @return the status code written, which is 408 instead of code for a timed out request
+*/
+uint16_t write_to_audit_code(conn_t *conn, const char *method, const char *uri, uint16_t code) {
+    char *header = conn ? conn_get_header(conn, "Request-Id") : NULL;
     if (!header)
         header = "0";
-    fprintf(stderr, "%s,%s,%u,%s\n", request_get_str(conn_get_request(conn)), conn_get_uri(conn),
-        response_get_code(res), header);
+    code = deadline_audit_code(code);
+    // A request that never got as far as its URI (e.g. it timed out idle) has none
+    fprintf(stderr, "%s,%s,%u,%s\n", method, uri ? uri : "", code, header);
+    return code;
 }
 
-void handle_connection(int connfd) {
+void handle_connection(int connfd, uint64_t seq) {
 
-    conn_t *conn = conn_new(connfd);
+    task_t *t = task_new(connfd, seq);
+    // Nothing was parsed, so there is nothing to audit
+    if (!t) {
+        send_status(connfd, 500, "Internal Server Error");
+        return;
+    }
+    handle_task(t);
 
-    const Response_t *res = conn_parse(conn);
+    // Delete conn struct
+    task_delete(&t);
+}
 
-    if (res != NULL) {
-        write_to_audit(conn, res);
-        conn_send_response(conn, res);
-    } else {
-        //debug("%s", conn_str(conn));
-        const Request_t *req = conn_get_request(conn);
-        if (req == &REQUEST_GET) {
-            handle_get(conn);
-        } else if (req == &REQUEST_PUT) {
-            handle_put(conn);
-        } else {
-            handle_unsupported(conn);
-        }
+/** @brief Routes a parsed task to its handler, or answers its parse error
+*/
+void handle_task(task_t *t) {
+    conn_t *conn = t->conn;
+    deadline_bind(t);
+    alloc_request(t);
+
+    // A request that ran out of time has been answered 408 (or just closed, if it never
+    // started), whether or not the part of its head that arrived parsed
+    if (deadline_answer(t)) {
+        write_to_audit_code(conn, request_get_str(conn_get_request(conn)), conn_get_uri(conn), 408);
+        return;
+    }
+    if (t->res != NULL) {
+        write_to_audit(conn, t->res);
+        conn_send_response(conn, t->res);
+        return;
     }
 
-    // Delete conn struct
-    conn_delete(&conn);
+    //debug("%s", conn_str(conn));
+    const Request_t *req = conn_get_request(conn);
+    if (req == &REQUEST_GET) {
+        handle_get(t);
+    } else if (head_is_method(&t->head, "POST") && !strcmp(conn_get_uri(conn), BATCH_URI)) {
+        handle_batch(t);
+    } else if (repl_read_only() && (req == &REQUEST_PUT || head_is_method(&t->head, "POST")
+                                       || head_is_method(&t->head, "PATCH"))) {
+        handle_read_only(t);
+    } else if (req == &REQUEST_PUT) {
+        handle_put(t);
+    } else if (head_is_method(&t->head, "POST")) {
+        handle_append(t);
+    } else if (head_is_method(&t->head, "PATCH")) {
+        handle_patch(t);
+    } else {
+        handle_unsupported(t);
+    }
 }
 
-void handle_get(conn_t *conn) {
+void handle_get(task_t *t) {
+    conn_t *conn = t->conn;
+
+    // Change log feed (primary), replication status (follower), timeout and allocation counts
+    if (repl_serve(t) || deadline_serve(t) || alloc_serve(t))
+        return;
+
+    // Small objects: share one disk read among every concurrent GET of the same URI
+    if (flight_enabled() && flight_serve(t))
+        return;
 
     char *uri = conn_get_uri(conn);
     //debug("handling get request for %s", uri);
     const Response_t *res = NULL;
 
-    // What are the steps in here?
-
-    // 1. Open the file.
-    pthread_mutex_lock(&file_creation_lock);
-    pthread_mutex_unlock(&file_creation_lock);
-
-    int fd = open(uri, O_RDONLY);
-    // If  open it returns < 0, then use the result appropriately
-    //   a. Cannot access -- use RESPONSE_FORBIDDEN
-    //   b. Cannot find the file -- use RESPONSE_NOT_FOUND
-    //   c. other error? -- use RESPONSE_INTERNAL_SERVER_ERROR
-    // (hint: check errno for these cases)!
-    if (fd < 0) {
-        if (errno == EACCES) {
-            res = &RESPONSE_FORBIDDEN;
-            goto out_failed;
-        }
-        if (errno == ENOENT) {
-            res = &RESPONSE_NOT_FOUND;
-            goto out_failed;
-        }
-        res = &RESPONSE_INTERNAL_SERVER_ERROR;
-        goto out_failed;
-    }
-    // Put a shared lock on the resource when GET-ing
-    int ret = flock(fd, LOCK_SH);
-    if (ret) {
-        goto out_failed;
-    }
-    // 2. Get the size of the file.
-    // (hint: checkout the function fstat)!
-    struct stat st;
-    fstat(fd, &st);
-    size_t file_size = st.st_size;
-
-    // 3. Check if the file is a directory, because directories *will*
-    // open, but are not valid.
-    // (hint: checkout the macro "S_IFDIR", which you can use after you call fstat!)
-    if (S_IFDIR == (st.st_mode & S_IFMT)) {
-        res = &RESPONSE_FORBIDDEN;
+    // 1. Open the file (or reuse a cached fd), put a shared lock on it and get its size.
+    // Directories *will* open, but are not valid, so fdcache_open rejects them too.
+    fd_ref_t ref;
+    res = fdcache_open(uri, &ref);
+    if (res)
         goto out_failed;
-    }
 
-    // 4. Send the file
-    // (hint: checkout the conn_send_file function!)
-    res = conn_send_file(conn, fd, file_size);
+    // 2. Send the file. The fd may be shared through the cache, so don't move its offset.
+    res = send_file(t->connfd, ref.fd, &ref.st);
     if (res == NULL) {
         res = &RESPONSE_OK;
     }
 
     // Close the file descriptor and remove the lock
     write_to_audit(conn, res);
-    close(fd);
+    fdcache_close(&ref);
     return;
 
 // Write an auxilliary response only if the response code is erroneous
 out_failed:
     write_to_audit(conn, res);
     conn_send_response(conn, res);
-    close(fd);
 }
 
-void handle_unsupported(conn_t *conn) {
+void handle_unsupported(task_t *t) {
+    conn_t *conn = t->conn;
 
     // send responses
     write_to_audit(conn, &RESPONSE_NOT_IMPLEMENTED);
     conn_send_response(conn, &RESPONSE_NOT_IMPLEMENTED);
 }
 
-void handle_put(conn_t *conn) {
+/** @brief Rejects a write on a follower; only its replication thread changes its directory
+ */
+void handle_read_only(task_t *t) {
+    conn_t *conn = t->conn;
+    const char *method = "PATCH";
+    if (conn_get_request(conn) == &REQUEST_PUT)
+        method = "PUT";
+    else if (head_is_method(&t->head, "POST"))
+        method = "POST";
+    write_to_audit_code(conn, method, conn_get_uri(conn), 403);
+    conn_send_response(conn, &RESPONSE_FORBIDDEN);
+}
 
-    char *uri = conn_get_uri(conn);
-    const Response_t *res = NULL;
+/** @brief Opens uri for writing the way every write method must: under the file creation lock,
+ *         creating it if allowed, and returning with an exclusive flock held.
+ *
+ *  @param flags extra open flags, e.g. O_APPEND
+ *  @param create whether a missing file should be created (otherwise 404)
+ *  @param existed set to whether the file existed before this call
+ *  @param res set to the error response on failure
+ *
+ *  @return the locked fd, or -1 on failure
+ */
+int open_locked_for_write(
+    const char *uri, int flags, bool create, bool *existed, const Response_t **res) {
 
     // Lock the fcl (Start of critical region)
     pthread_mutex_lock(&file_creation_lock);
 
-    // Check if file already exists before opening it.
-    bool existed = access(uri, F_OK) == 0;
-    // Create the file atomically
     int fd;
-    if (!existed) {
-        fd = open(uri, O_CREAT | O_WRONLY, 0600);
+    while (1) {
+        // Check if file already exists before opening it.
+        *existed = layout_access(uri, F_OK) == 0;
+        if (!*existed && !create) {
+            *res = &RESPONSE_NOT_FOUND;
+            pthread_mutex_unlock(&file_creation_lock);
+            return -1;
+        }
+        // Create the file atomically
+        if (!*existed) {
+            fd = layout_open(uri, O_CREAT | O_WRONLY | flags, 0600);
+        }
+        // Otherwise wait to see if another thread is going to create the file if it doesn't exist already
+        else {
+            fd = layout_open(uri, O_WRONLY | flags, 0);
+            // Removed since the check by a PUT that created it and then failed
+            if (fd < 0 && errno == ENOENT)
+                continue;
+        }
+        // Error checking
+        if (fd < 0) {
+            if (errno == EACCES || errno == EISDIR || errno == ENOENT) {
+                *res = &RESPONSE_FORBIDDEN;
+            } else {
+                *res = &RESPONSE_INTERNAL_SERVER_ERROR;
+            }
+            pthread_mutex_unlock(&file_creation_lock);
+            return -1;
+        }
+        // Put exclusive flock, holding back new readers of a cached fd meanwhile
+        struct stat st;
+        fdcache_writer_t w;
+        fdcache_write_begin(uri, &w);
+        int locked = flock(fd, LOCK_EX);
+        fdcache_write_end(&w);
+        if (locked || fstat(fd, &st)) {
+            *res = &RESPONSE_INTERNAL_SERVER_ERROR;
+            pthread_mutex_unlock(&file_creation_lock);
+            close(fd);
+            return -1;
+        }
+        // Or it was removed while this thread waited for the lock
+        if (st.st_nlink > 0)
+            break;
+        close(fd);
     }
-    // Otherwise wait to see if another thread is going to create the file if it doesn't exist already
-    else {
-        fd = open(uri, O_WRONLY, 0);
+
+    pthread_mutex_unlock(&file_creation_lock);
+    return fd;
+}
+
+/** @brief For a client that sent Expect: 100-continue, checks what can be checked before
+ *         the body is read: that the method is one that takes a body, and for a PUT that the
+ *         target is not a directory and is writable, and that the declared length fits the
+ *         file size limit and the free space. A rejected request is answered and audited
+ *         right away; the client has not sent the body, so there is nothing to drain.
+ *
+ *  @return the status the request was answered with, or 0 if its body should be read
+ */
+uint16_t expect_rejected(task_t *t) {
+    conn_t *conn = t->conn;
+    const Request_t *req = conn_get_request(conn);
+    if (!t->expect_continue || t->continued || req == &REQUEST_GET)
+        return 0;
+    // A batch is a read, even on a read-only follower; it needs its body
+    if (head_is_method(&t->head, "POST") && !strcmp(conn_get_uri(conn), BATCH_URI))
+        return 0;
+    bool put = req == &REQUEST_PUT;
+    bool body_method = put || head_is_method(&t->head, "POST") || head_is_method(&t->head, "PATCH");
+    if (!body_method || repl_read_only()) {
+        // Answered by handle_unsupported or handle_read_only
+        handle_task(t);
+        return body_method ? 403 : 501;
     }
-    // Error checking
-    if (fd < 0) {
-        if (errno == EACCES || errno == EISDIR || errno == ENOENT) {
-            res = &RESPONSE_FORBIDDEN;
-            goto out;
-        } else {
-            res = &RESPONSE_INTERNAL_SERVER_ERROR;
-            goto out;
+    if (!put)
+        return 0;
+
+    char *uri = conn_get_uri(conn);
+    char *cl = conn_get_header(conn, "Content-Length");
+    uint64_t len = cl ? strtoull(cl, NULL, 10) : 0;
+    uint16_t code = 0;
+    const char *phrase = NULL;
+
+    struct stat st;
+    char dir[LAYOUT_PATH_MAX];
+    bool exists = layout_stat(uri, &st) == 0;
+    bool forbidden;
+    if (exists) {
+        forbidden = S_ISDIR(st.st_mode) || layout_access(uri, W_OK);
+    } else if (errno != ENOENT) {
+        forbidden = true;
+    } else {
+        // A new file needs a writable directory; a missing hashed leaf is created on demand
+        forbidden = access(layout_dir(uri, dir), W_OK) && !(errno == ENOENT && layout_hashed());
+    }
+    if (forbidden) {
+        code = 403;
+        phrase = "Forbidden";
+    }
+
+    struct rlimit rl;
+    if (!code && !getrlimit(RLIMIT_FSIZE, &rl) && rl.rlim_cur != RLIM_INFINITY
+        && len > rl.rlim_cur) {
+        code = 413;
+        phrase = "Payload Too Large";
+    }
+
+    // Overwriting gives the old blocks back
+    struct statvfs vfs;
+    if (!code && !statvfs(".", &vfs)
+        && len > (uint64_t) vfs.f_bavail * vfs.f_frsize + (exists ? st.st_blocks * 512 : 0)) {
+        code = 507;
+        phrase = "Insufficient Storage";
+    }
+
+    if (!code)
+        return 0;
+    uint16_t audited = write_to_audit_code(conn, "PUT", uri, code);
+    send_status(t->connfd, code, phrase);
+    return audited;
+}
+
+/** @brief Answers a retried PUT with the status of the earlier one, without touching the file.
+ *         The body is read and thrown away so the client sees the response rather than a reset,
+ *         unless the client is still waiting for 100 Continue and never sent it.
+ */
+static void handle_put_replay(task_t *t, uint16_t code) {
+    const Response_t *res = code == 201 ? &RESPONSE_CREATED : &RESPONSE_OK;
+    if (t->spool < 0 && !t->expect_continue) {
+        int null = open("/dev/null", O_WRONLY);
+        const Response_t *drained = null >= 0 ? task_recv_body(t, null) : NULL;
+        if (drained)
+            res = drained;
+        if (null >= 0)
+            close(null);
+    }
+    write_to_audit(t->conn, res);
+    conn_send_response(t->conn, res);
+}
+
+void handle_put(task_t *t) {
+    // A retry of a PUT that completed (or is still running) is not executed a second time
+    idem_entry_t *claim = NULL;
+    if (idem_enabled()) {
+        uint16_t code
+            = idem_begin(conn_get_header(t->conn, "Request-Id"), conn_get_uri(t->conn), &claim);
+        if (code == 500) {
+            write_to_audit(t->conn, &RESPONSE_INTERNAL_SERVER_ERROR);
+            conn_send_response(t->conn, &RESPONSE_INTERNAL_SERVER_ERROR);
+            task_discard_body(t);
+            return;
+        }
+        if (code) {
+            handle_put_replay(t, code);
+            return;
         }
     }
-    // Put exclusive flock
-    if (flock(fd, LOCK_EX)) {
-        res = &RESPONSE_INTERNAL_SERVER_ERROR;
+
+    uint16_t code = coalesce_enabled() ? coalesce_put(t) : handle_put_now(t);
+    idem_finish(claim, code);
+}
+
+/** @brief Performs a PUT: truncates and rewrites the whole file. A PUT that fails removes the
+ *         file if it created it.
+ *
+ *  @return the status code audited for it
+*/
+uint16_t handle_put_now(task_t *t) {
+    conn_t *conn = t->conn;
+    uint16_t code = expect_rejected(t);
+    if (code)
+        return code;
+
+    char *uri = conn_get_uri(conn);
+    const Response_t *res = NULL;
+    uint16_t audited;
+
+    bool existed = true;
+    int fd = open_locked_for_write(uri, 0, true, &existed, &res);
+    if (fd < 0)
         goto out;
-    }
 
-    pthread_mutex_unlock(&file_creation_lock);
-    // Truncate the file
-    ftruncate(fd, 0);
+    char *cl = conn_get_header(conn, "Content-Length");
+    uint64_t len = cl ? strtoull(cl, NULL, 10) : 0;
+    if (len >= BIGPUT_PREALLOC_MIN) {
+        // Reserve the space first, so a full disk fails the request before any of the body is read
+        code = bigput_prealloc(fd, len);
+        if (code)
+            goto out;
+        // Truncating would give the preallocated blocks back, so overwrite and cut the old tail.
+        // All-zero blocks become holes.
+        res = &RESPONSE_NOT_IMPLEMENTED;
+        if (bigput_use_direct(len))
+            res = bigput_recv_direct(t, uri, fd, len);
+        if (res == &RESPONSE_NOT_IMPLEMENTED)
+            res = bigput_recv_sparse(t, fd, len);
+        if (res == NULL)
+            ftruncate(fd, len);
+    } else {
+        // Truncate the file
+        ftruncate(fd, 0);
 
-    res = conn_recv_file(conn, fd);
+        res = task_recv_body(t, fd);
+    }
     if (res == NULL && existed) {
         res = &RESPONSE_OK;
     } else if (res == NULL && !existed) {
@@ -248,12 +691,240 @@ void handle_put(conn_t *conn) {
     }
 
 out:
-    write_to_audit(conn, res);
+    // code is set instead of res for statuses the helper library has no response for
+    if (code) {
+        audited = write_to_audit_code(conn, "PUT", uri, code);
+        send_status(t->connfd, code, code == 507 ? "Insufficient Storage" : "Payload Too Large");
+    } else {
+        audited = write_to_audit(conn, res);
+        conn_send_response(conn, res);
+    }
+    bool ok = res == &RESPONSE_OK || res == &RESPONSE_CREATED;
+    if (fd >= 0) {
+        if (ok)
+            repl_record(uri, fd);
+        else if (!existed)
+            layout_unlink(uri);
+        fdcache_invalidate(uri);
+        close(fd);
+    }
+    // Only once the lock is released
+    if (!ok)
+        task_discard_body(t);
+    return audited;
+}
+
+/** @brief Handles POST /uri: appends the body to the file (creating it if needed) instead of
+ *         rewriting the whole thing like PUT does
+ */
+void handle_append(task_t *t) {
+    conn_t *conn = t->conn;
+
+    char *uri = conn_get_uri(conn);
+    const Response_t *res = NULL;
+
+    // O_APPEND makes every write land at the (locked) end of file
+    bool existed;
+    int fd = open_locked_for_write(uri, O_APPEND, true, &existed, &res);
+    if (fd < 0)
+        goto out;
+
+    res = task_recv_body(t, fd);
+    if (res == NULL)
+        res = existed ? &RESPONSE_OK : &RESPONSE_CREATED;
+
+out:
+    write_to_audit_code(conn, "POST", uri, response_get_code(res));
     conn_send_response(conn, res);
+    if (fd >= 0) {
+        if (res == &RESPONSE_OK || res == &RESPONSE_CREATED)
+            repl_record(uri, fd);
+        fdcache_invalidate(uri);
+        close(fd);
+    }
+}
 
-    // Release this lock if it was held and an error arose
-    pthread_mutex_unlock(&file_creation_lock);
-    close(fd);
+/** @brief Parses a "bytes start-end/total" Content-Range value, where total may also be "*"
+ *
+ *  @return true if the range is well formed
+ */
+static bool parse_content_range(const char *val, uint64_t *start, uint64_t *end) {
+    char *p = NULL;
+    if (strncmp(val, "bytes ", 6) || !isdigit((unsigned char) val[6]))
+        return false;
+    errno = 0;
+    *start = strtoull(val + 6, &p, 10);
+    if (errno || *p != '-' || !isdigit((unsigned char) p[1]))
+        return false;
+    *end = strtoull(p + 1, &p, 10);
+    if (errno || *p != '/' || *end < *start)
+        return false;
+    // The complete length is informational only
+    if (!strcmp(p + 1, "*"))
+        return true;
+    if (!isdigit((unsigned char) p[1]))
+        return false;
+    uint64_t total = strtoull(p + 1, &p, 10);
+    return !errno && *p == '\0' && total > *end;
+}
+
+/** @brief Handles PATCH /uri with a Content-Range header: overwrites only the given byte window
+ *         of an existing file
+ */
+void handle_patch(task_t *t) {
+    conn_t *conn = t->conn;
+
+    char *uri = conn_get_uri(conn);
+    const Response_t *res = NULL;
+    // A status the helper library has no response for
+    uint16_t code = 0;
+    int fd = -1;
+
+    char range[128];
+    char *cl = conn_get_header(conn, "Content-Length");
+    uint64_t start, end;
+    if (!cl || !head_get(&t->head, "Content-Range", range, sizeof(range))
+        || !parse_content_range(range, &start, &end)
+        || strtoull(cl, NULL, 10) != end - start + 1) {
+        res = &RESPONSE_BAD_REQUEST;
+        goto out;
+    }
+
+    bool existed;
+    fd = open_locked_for_write(uri, 0, false, &existed, &res);
+    if (fd < 0)
+        goto out;
+
+    // Don't let a patch leave a hole between the old end of file and the window
+    struct stat st;
+    if (fstat(fd, &st)) {
+        res = &RESPONSE_INTERNAL_SERVER_ERROR;
+        goto out;
+    }
+    if (start > (uint64_t) st.st_size) {
+        code = 416;
+        goto out;
+    }
+    if (lseek(fd, start, SEEK_SET) < 0) {
+        res = &RESPONSE_INTERNAL_SERVER_ERROR;
+        goto out;
+    }
+    res = task_recv_body(t, fd);
+    if (res == NULL)
+        res = &RESPONSE_OK;
+
+out:
+    if (code) {
+        write_to_audit_code(conn, "PATCH", uri, code);
+        send_status(t->connfd, code, "Range Not Satisfiable");
+    } else {
+        write_to_audit_code(conn, "PATCH", uri, response_get_code(res));
+        conn_send_response(conn, res);
+    }
+    bool ok = res == &RESPONSE_OK;
+    if (fd >= 0) {
+        if (ok)
+            repl_record(uri, fd);
+        fdcache_invalidate(uri);
+        close(fd);
+    }
+    // Only once the lock is released
+    if (!ok)
+        task_discard_body(t);
+}
+
+/** @brief Sends 200 OK with the whole of fd (described by st) as the body, using sendfile at
+ *         explicit offsets so fds shared through the fd cache keep their file offset
+ *
+ *  @return NULL on success, otherwise the response to audit
+ */
+const Response_t *send_file(int connfd, int fd, const struct stat *st) {
+    uint64_t count = st->st_size;
+    if (send_ok_header(connfd, count))
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+    // Fewer blocks than the size needs: the file has holes
+    bool sparse = (uint64_t) st->st_blocks * 512 < count;
+    if (sparse ? sendfile_sparse(connfd, fd, count) : sendfile_all(connfd, fd, 0, count))
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+    return NULL;
+}
+
+/** @brief sendfile()s count bytes of fd starting at off, without touching fd's offset
+ *
+ *  @return 0 on success, -1 on error or early end of file
+ */
+int sendfile_all(int connfd, int fd, off_t off, uint64_t count) {
+    while (count) {
+        ssize_t n = sendfile(connfd, fd, &off, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        count -= n;
+        // Still making progress, so restart the write-stall deadline
+        deadline_touch();
+    }
+    return 0;
+}
+
+/** @brief Sends the first count bytes of a file with holes: data with sendfile, found with
+ *         SEEK_DATA/SEEK_HOLE, and holes from a buffer of zeros, so they never fill the page cache.
+ *         Moves fd's offset, which nothing else relies on.
+ *
+ *  @return 0 on success, -1 on error
+ */
+int sendfile_sparse(int connfd, int fd, uint64_t count) {
+    static const char zeros[64 * 1024];
+    off_t off = 0;
+    while ((uint64_t) off < count) {
+        off_t data = lseek(fd, off, SEEK_DATA);
+        // No SEEK_DATA on this file system: send it all the usual way
+        if (data < 0 && errno != ENXIO)
+            return sendfile_all(connfd, fd, off, count - off);
+        // ENXIO: nothing but hole up to the end of file
+        if (data < 0 || (uint64_t) data > count)
+            data = count;
+        while (off < data) {
+            size_t n = sizeof(zeros);
+            if ((uint64_t) (data - off) < n)
+                n = data - off;
+            if (write_all(connfd, (char *) zeros, n) != (ssize_t) n)
+                return -1;
+            off += n;
+            deadline_touch();
+        }
+        if ((uint64_t) off >= count)
+            break;
+        off_t hole = lseek(fd, off, SEEK_HOLE);
+        if (hole < 0 || (uint64_t) hole > count)
+            hole = count;
+        if (sendfile_all(connfd, fd, off, hole - off))
+            return -1;
+        off = hole;
+    }
+    return 0;
+}
+
+/** @brief Sends a bare response for a status the helper library has no Response_t for
+ */
+void send_status(int connfd, uint16_t code, const char *phrase) {
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %u %s\r\nContent-Length: %zu\r\n\r\n%s\n", code,
+        phrase, strlen(phrase) + 1, phrase);
+    write_all(connfd, buf, len);
+}
+
+/** @brief Sends the head of a 200 OK whose body of len bytes the caller sends next, and
+ *         (re)starts the write deadline
+ *
+ *  @return 0 on success, -1 if the head couldn't be sent
+ */
+int send_ok_header(int connfd, uint64_t len) {
+    char header[64];
+    int hlen = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n",
+        (unsigned long) len);
+    deadline_touch();
+    return write_all(connfd, header, hlen) == hlen ? 0 : -1;
 }
 
 // THREAD POOL CODE
@@ -264,19 +935,19 @@ struct thread_pool {
 };
 // start_worker: main function that handles the request
 // 1) While there is nothing in the queue block
-// 2) Try to pop off a connection file descriptor
+// 2) Try to pop off an accepted connection
 // 3) Handle any errors
 // 4) Process request (wait until resource is usable) & write to stderr
 // 6) Close connection
 // 8) Repeat forever
 void *start_worker() {
-    int connfd;
+    accepted_t *a;
     while (1) {
-        queue_pop(conn_queue, (void **) &connfd);
-        // Don't handle the connection if it was bad nor print anything to audit log (not expected)
-        if (connfd < 0)
-            continue;
-        handle_connection(connfd);
+        queue_pop(conn_queue, (void **) &a);
+        int connfd = a->connfd;
+        uint64_t seq = a->seq;
+        free(a);
+        handle_connection(connfd, seq);
         close(connfd);
     }
 
@@ -1,16 +1,38 @@
 #pragma once
 
 #include "connection.h"
+#include "head.h"
 #include "queue.h"
+#include "task.h"
 #include <stdint.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
-void handle_connection(int);
+extern pthread_mutex_t file_creation_lock;
 
-void handle_get(conn_t *);
-void handle_put(conn_t *);
-void handle_unsupported(conn_t *);
+void handle_connection(int connfd, uint64_t seq);
+void handle_task(task_t *);
+
+uint16_t write_to_audit(conn_t *, const Response_t *);
+uint16_t write_to_audit_code(conn_t *, const char *method, const char *uri, uint16_t code);
+
+void handle_get(task_t *);
+void handle_put(task_t *);
+uint16_t handle_put_now(task_t *);
+void handle_append(task_t *);
+void handle_patch(task_t *);
+void handle_unsupported(task_t *);
+void handle_read_only(task_t *);
+
+uint16_t expect_rejected(task_t *);
+int open_locked_for_write(
+    const char *uri, int flags, bool create, bool *existed, const Response_t **res);
+void send_status(int connfd, uint16_t code, const char *phrase);
+int send_ok_header(int connfd, uint64_t len);
+const Response_t *send_file(int connfd, int fd, const struct stat *st);
+int sendfile_all(int connfd, int fd, off_t off, uint64_t count);
+int sendfile_sparse(int connfd, int fd, uint64_t count);
 
 // THREAD POOL CODE
 /** @struct thread_pool_t
@@ -0,0 +1,158 @@
+#include "idem.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define IDEM_BUCKETS 4096
+
+struct idem_entry {
+    char rid[IDEM_RID_MAX];
+    char uri[64];
+    // Set once the PUT has completed; until then its retries wait
+    bool done;
+    uint16_t code;
+    uint64_t expires_ms;
+    struct idem_entry *next;
+    // Completed entries in expiry order, oldest first
+    struct idem_entry *newer;
+};
+
+static long idem_ttl_ms;
+static pthread_mutex_t idem_lock = PTHREAD_MUTEX_INITIALIZER;
+// Broadcast whenever a PUT finishes; waiters re-check their own entry
+static pthread_cond_t idem_done = PTHREAD_COND_INITIALIZER;
+static idem_entry_t *buckets[IDEM_BUCKETS];
+static idem_entry_t *oldest, *newest;
+static size_t idem_count;
+
+/** @brief Turns on the idempotency table
+ */
+void idem_init(long ttl_s) {
+    idem_ttl_ms = ttl_s * 1000;
+}
+
+/** @brief Whether the idempotency table is on
+ */
+bool idem_enabled(void) {
+    return idem_ttl_ms > 0;
+}
+
+static uint64_t idem_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** @brief Hashes a Request-Id and URI to their bucket
+ */
+static size_t idem_bucket(const char *rid, const char *uri) {
+    size_t h = 5381;
+    for (; *rid; rid++)
+        h = h * 33 + (unsigned char) *rid;
+    // Keeps ("a", "bc") apart from ("ab", "c")
+    h = h * 33 + '/';
+    for (; *uri; uri++)
+        h = h * 33 + (unsigned char) *uri;
+    return h % IDEM_BUCKETS;
+}
+
+/** @brief Unlinks e from its bucket and frees it. Must hold idem_lock, and e must already be
+ *         off the expiry list.
+ */
+static void idem_remove(idem_entry_t *e) {
+    idem_entry_t **pp = &buckets[idem_bucket(e->rid, e->uri)];
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+    idem_count--;
+    free(e);
+}
+
+/** @brief Drops the oldest completed entry. Must hold idem_lock.
+ */
+static void idem_evict_oldest(void) {
+    idem_entry_t *e = oldest;
+    oldest = e->newer;
+    if (!oldest)
+        newest = NULL;
+    idem_remove(e);
+}
+
+/** @brief Looks up a PUT before it runs (see idem.h)
+ *
+ *  @return the earlier PUT's status, 500 if out of memory, or 0 if this one should run
+ */
+uint16_t idem_begin(const char *rid, const char *uri, idem_entry_t **claim) {
+    *claim = NULL;
+    if (!rid || strlen(rid) >= IDEM_RID_MAX)
+        return 0;
+
+    pthread_mutex_lock(&idem_lock);
+    while (1) {
+        // Every completed entry has the same lifetime, so they expire oldest first
+        uint64_t now = idem_now_ms();
+        while (oldest && oldest->expires_ms <= now)
+            idem_evict_oldest();
+
+        idem_entry_t *e = buckets[idem_bucket(rid, uri)];
+        while (e && (strcmp(e->rid, rid) || strcmp(e->uri, uri)))
+            e = e->next;
+        if (e && e->done) {
+            uint16_t code = e->code;
+            pthread_mutex_unlock(&idem_lock);
+            return code;
+        }
+        if (e) {
+            // The original is still running. If it fails its entry goes away and this
+            // request claims a new one on the next pass.
+            pthread_cond_wait(&idem_done, &idem_lock);
+            continue;
+        }
+
+        if (idem_count >= IDEM_CAPACITY && oldest)
+            idem_evict_oldest();
+        // Everything tracked is still in progress; run untracked rather than wait for room
+        if (idem_count >= IDEM_CAPACITY)
+            break;
+        e = calloc(1, sizeof(idem_entry_t));
+        if (!e) {
+            pthread_mutex_unlock(&idem_lock);
+            return 500;
+        }
+        snprintf(e->rid, sizeof(e->rid), "%s", rid);
+        snprintf(e->uri, sizeof(e->uri), "%s", uri);
+        size_t b = idem_bucket(rid, uri);
+        e->next = buckets[b];
+        buckets[b] = e;
+        idem_count++;
+        *claim = e;
+        break;
+    }
+    pthread_mutex_unlock(&idem_lock);
+    return 0;
+}
+
+/** @brief Records how a claimed PUT ended and wakes its retries
+ */
+void idem_finish(idem_entry_t *claim, uint16_t code) {
+    if (!claim)
+        return;
+    pthread_mutex_lock(&idem_lock);
+    if (code == 200 || code == 201) {
+        claim->done = true;
+        claim->code = code;
+        claim->expires_ms = idem_now_ms() + idem_ttl_ms;
+        if (newest)
+            newest->newer = claim;
+        else
+            oldest = claim;
+        newest = claim;
+    } else {
+        idem_remove(claim);
+    }
+    pthread_cond_broadcast(&idem_done);
+    pthread_mutex_unlock(&idem_lock);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Most PUTs remembered at once, completed or in progress
+#define IDEM_CAPACITY 16384
+// Longest Request-Id that is tracked; PUTs with longer ones run as usual
+#define IDEM_RID_MAX 64
+
+typedef struct idem_entry idem_entry_t;
+
+/** @brief Turns on the idempotency table for retried PUTs.
+ *
+ *         A PUT is identified by its Request-Id header together with its
+ *         URI. When one completes with 200 or 201, that status is kept for
+ *         ttl_s seconds, and a PUT with the same identity in that time is
+ *         answered with it instead of being executed again. At most
+ *         IDEM_CAPACITY PUTs are tracked; when the table is full, the
+ *         completed entry closest to expiry makes room.
+ *
+ *  @param ttl_s how long a completed PUT's status is kept, in seconds
+ */
+void idem_init(long ttl_s);
+
+/** @brief Whether the idempotency table is on
+ */
+bool idem_enabled(void);
+
+/** @brief Looks up a PUT before it runs. If the same Request-Id and URI are still being
+ *         written by another request, waits for that request to finish first.
+ *
+ *  @param rid the Request-Id header, or NULL
+ *  @param uri the target URI
+ *  @param claim set to the entry the caller must pass to idem_finish once the PUT is answered,
+ *         or to NULL if the PUT is not tracked (no Request-Id, or the table is full)
+ *
+ *  @return the status of the earlier, completed PUT if there was one (the caller must not
+ *          execute this one), 500 if there was no memory to track it (the caller must answer
+ *          500 and not execute it), otherwise 0
+ */
+uint16_t idem_begin(const char *rid, const char *uri, idem_entry_t **claim);
+
+/** @brief Records how a claimed PUT ended and wakes its retries. A 200 or 201 is kept for
+ *         the retries to reuse; anything else is forgotten, so the next retry runs again.
+ *         Does nothing if claim is NULL.
+ */
+void idem_finish(idem_entry_t *claim, uint16_t code);
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include "layout.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LAYOUT_FANOUT 256
+
+static bool hashed;
+// The top-level ab/ directories, opened once
+static int top_fds[LAYOUT_FANOUT];
+
+/** @brief FNV-1a hash of a URI. Stored objects depend on it, so it must never change.
+ */
+static uint32_t layout_hash(const char *uri) {
+    uint32_t h = 2166136261u;
+    for (; *uri; uri++)
+        h = (h ^ (unsigned char) *uri) * 16777619u;
+    return h;
+}
+
+int layout_init(bool use_hashed) {
+    if (!use_hashed)
+        return 0;
+    for (int i = 0; i < LAYOUT_FANOUT; i++) {
+        char name[3];
+        snprintf(name, sizeof(name), "%02x", i);
+        if (mkdir(name, 0700) && errno != EEXIST)
+            return -1;
+        top_fds[i] = open(name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (top_fds[i] < 0)
+            return -1;
+    }
+    hashed = true;
+    return 0;
+}
+
+bool layout_hashed(void) {
+    return hashed;
+}
+
+char *layout_path(const char *uri, char buf[LAYOUT_PATH_MAX]) {
+    if (!hashed) {
+        snprintf(buf, LAYOUT_PATH_MAX, "%s", uri);
+    } else {
+        uint32_t h = layout_hash(uri);
+        snprintf(buf, LAYOUT_PATH_MAX, "%02x/%02x/%s", (h >> 8) & 0xff, h & 0xff, uri);
+    }
+    return buf;
+}
+
+char *layout_dir(const char *uri, char buf[LAYOUT_PATH_MAX]) {
+    if (!hashed) {
+        snprintf(buf, LAYOUT_PATH_MAX, ".");
+    } else {
+        uint32_t h = layout_hash(uri);
+        snprintf(buf, LAYOUT_PATH_MAX, "%02x/%02x", (h >> 8) & 0xff, h & 0xff);
+    }
+    return buf;
+}
+
+/** @brief The cached top-level directory of uri and its path below it ("cd/<uri>")
+ */
+static int layout_locate(const char *uri, char rel[LAYOUT_PATH_MAX]) {
+    uint32_t h = layout_hash(uri);
+    snprintf(rel, LAYOUT_PATH_MAX, "%02x/%s", h & 0xff, uri);
+    return top_fds[(h >> 8) & 0xff];
+}
+
+int layout_open(const char *uri, int flags, mode_t mode) {
+    if (!hashed)
+        return open(uri, flags, mode);
+
+    char rel[LAYOUT_PATH_MAX];
+    int dirfd = layout_locate(uri, rel);
+    int fd = openat(dirfd, rel, flags, mode);
+    if (fd < 0 && errno == ENOENT && (flags & O_CREAT)) {
+        // First object in this leaf; another thread may be creating it too
+        rel[2] = '\0';
+        if (mkdirat(dirfd, rel, 0700) && errno != EEXIST)
+            return -1;
+        rel[2] = '/';
+        fd = openat(dirfd, rel, flags, mode);
+    }
+    return fd;
+}
+
+int layout_access(const char *uri, int mode) {
+    if (!hashed)
+        return access(uri, mode);
+    char rel[LAYOUT_PATH_MAX];
+    int dirfd = layout_locate(uri, rel);
+    return faccessat(dirfd, rel, mode, 0);
+}
+
+int layout_stat(const char *uri, struct stat *st) {
+    if (!hashed)
+        return stat(uri, st);
+    char rel[LAYOUT_PATH_MAX];
+    int dirfd = layout_locate(uri, rel);
+    return fstatat(dirfd, rel, st, 0);
+}
+
+int layout_unlink(const char *uri) {
+    if (!hashed)
+        return unlink(uri);
+    char rel[LAYOUT_PATH_MAX];
+    int dirfd = layout_locate(uri, rel);
+    return unlinkat(dirfd, rel, 0);
+}
+
+/** @brief Whether name could be a request URI (the same grammar as conn_parse)
+ */
+static bool layout_is_uri(const char *name) {
+    size_t len = strlen(name);
+    if (len < 1 || len > 63)
+        return false;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '.' && name[i] != '-')
+            return false;
+    }
+    return true;
+}
+
+/** @brief Appends name to the growable array *names, which has *count of *cap slots used
+ *
+ *  @param name a string to hand over, or NULL if allocating it failed
+ *
+ *  @return false if out of memory (name is freed)
+ */
+static bool layout_list_add(char ***names, size_t *count, size_t *cap, char *name) {
+    if (!name)
+        return false;
+    if (*count == *cap) {
+        size_t grown = *cap ? *cap * 2 : 1024;
+        char **bigger = realloc(*names, grown * sizeof(char *));
+        if (!bigger) {
+            free(name);
+            return false;
+        }
+        *names = bigger;
+        *cap = grown;
+    }
+    (*names)[(*count)++] = name;
+    return true;
+}
+
+/** @brief Whether name is one of the hashed layout's top-level directory names
+ */
+static bool layout_is_top(const char *name) {
+    return strlen(name) == 2 && isxdigit((unsigned char) name[0])
+           && isxdigit((unsigned char) name[1]) && !isupper((unsigned char) name[0])
+           && !isupper((unsigned char) name[1]);
+}
+
+int layout_migrate(void) {
+    // Collect the names first; renaming while reading a directory can skip or repeat entries
+    DIR *dir = opendir(".");
+    if (!dir)
+        return -1;
+    size_t count = 0, cap = 0;
+    char **names = NULL;
+    int failed = 0, saved_errno;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        struct stat st;
+        if (!layout_is_uri(de->d_name) || lstat(de->d_name, &st) || !S_ISREG(st.st_mode))
+            continue;
+        if (!layout_list_add(&names, &count, &cap, strdup(de->d_name))) {
+            closedir(dir);
+            errno = ENOMEM;
+            failed = -1;
+            goto out;
+        }
+    }
+    closedir(dir);
+
+    // Objects named like a top-level directory ("3f") have to make room for it first.
+    // '~' can't appear in a URI, so the temporary name can't clash with an object.
+    char aside[8];
+    for (size_t i = 0; i < count; i++) {
+        if (layout_is_top(names[i])) {
+            snprintf(aside, sizeof(aside), "%s~", names[i]);
+            if (renameat2(AT_FDCWD, names[i], AT_FDCWD, aside, RENAME_NOREPLACE))
+                fprintf(stderr, "%s: %s\n", names[i], strerror(errno));
+        }
+    }
+    // A previous run may have stopped after moving some aside
+    for (int i = 0; i < LAYOUT_FANOUT; i++) {
+        snprintf(aside, sizeof(aside), "%02x~", i);
+        struct stat st;
+        if (!lstat(aside, &st) && S_ISREG(st.st_mode)) {
+            bool listed = false;
+            for (size_t j = 0; j < count && !listed; j++)
+                listed = !strncmp(names[j], aside, 2) && names[j][2] == '\0';
+            // Whatever was already moved aside is picked up again by a re-run
+            if (!listed && !layout_list_add(&names, &count, &cap, strndup(aside, 2))) {
+                errno = ENOMEM;
+                failed = -1;
+                goto out;
+            }
+        }
+    }
+
+    if (layout_init(true))
+        failed = -1;
+    for (size_t i = 0; i < count && failed >= 0; i++) {
+        const char *src = names[i];
+        if (layout_is_top(names[i])) {
+            snprintf(aside, sizeof(aside), "%s~", names[i]);
+            src = aside;
+        }
+        char rel[LAYOUT_PATH_MAX];
+        int dirfd = layout_locate(names[i], rel);
+        rel[2] = '\0';
+        if (mkdirat(dirfd, rel, 0700) && errno != EEXIST) {
+            fprintf(stderr, "%s: %s\n", names[i], strerror(errno));
+            failed++;
+            continue;
+        }
+        rel[2] = '/';
+        // Never replace an object that is already in the hashed layout
+        if (renameat2(AT_FDCWD, src, dirfd, rel, RENAME_NOREPLACE)) {
+            fprintf(stderr, "%s: %s\n", names[i], strerror(errno));
+            failed++;
+        }
+    }
+out:
+    // Keep the error's errno for the caller
+    saved_errno = errno;
+    for (size_t i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    errno = saved_errno;
+    return failed;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Longest relative path for a URI: "ab/cd/" + 63 characters + NUL
+#define LAYOUT_PATH_MAX 70
+
+/** @brief Selects how URIs map to files in the working directory.
+ *
+ *         The flat layout (the default) stores every URI as a file of the
+ *         same name. The hashed layout stores it at ab/cd/<uri>, where ab and
+ *         cd are the two low bytes of the URI's FNV-1a hash in hex, so no
+ *         directory holds more than a 65536th of the objects. The 256
+ *         top-level directories are created if missing and kept open, and
+ *         files are opened relative to them with openat. Leaf directories are
+ *         created by the first write that needs one.
+ *
+ *  @return 0 on success, -1 if a top-level directory can't be created or opened
+ */
+int layout_init(bool hashed);
+
+/** @brief Whether the hashed layout is in use
+ */
+bool layout_hashed(void);
+
+/** @brief The path of uri relative to the working directory
+ *
+ *  @return buf
+ */
+char *layout_path(const char *uri, char buf[LAYOUT_PATH_MAX]);
+
+/** @brief The directory that holds uri, relative to the working directory
+ *
+ *  @return buf
+ */
+char *layout_dir(const char *uri, char buf[LAYOUT_PATH_MAX]);
+
+/** @brief open() for a URI. With O_CREAT, a missing leaf directory is created first.
+ */
+int layout_open(const char *uri, int flags, mode_t mode);
+
+/** @brief access() for a URI
+ */
+int layout_access(const char *uri, int mode);
+
+/** @brief stat() for a URI
+ */
+int layout_stat(const char *uri, struct stat *st);
+
+/** @brief unlink() for a URI
+ */
+int layout_unlink(const char *uri);
+
+/** @brief Moves every object in a flat working directory into the hashed layout.
+ *
+ *         Only regular files whose names are valid URIs are moved, with
+ *         renames that never replace an existing object, so it can be re-run
+ *         after an interruption. The server must not be running on the
+ *         directory meanwhile.
+ *
+ *  @return the number of objects that could not be moved, or -1 on error
+ */
+int layout_migrate(void);
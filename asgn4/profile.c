@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include "profile.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Frames kept per sample, leaf first
+#define PROFILE_DEPTH 24
+// Distinct stacks counted per thread
+#define PROFILE_SLOTS 512
+// Slots tried before a sample is dropped
+#define PROFILE_PROBES 16
+// Threads that get a table of their own. Threads started after that (short-lived per-request
+// helpers, once enough have come and gone) share one more table.
+#define PROFILE_THREADS 256
+// The handler's own frame and the signal trampoline sit on top of every backtrace
+#define PROFILE_SKIP 2
+
+typedef struct {
+    uint64_t count;
+    uint64_t hash;
+    // 0 while the slot is free and -1 while a writer fills it in; set last, once pcs and count
+    // are filled in
+    int depth;
+    void *pcs[PROFILE_DEPTH];
+} profile_slot_t;
+
+/** @struct profile_table_t
+ *
+ *  @brief One thread's samples, or those of every thread past PROFILE_THREADS.
+ *         Writers (in the signal handler) claim a free slot with a CAS before
+ *         filling it in, and only add to counts after that, so no locks are
+ *         needed; the dumper reads slots once they're published.
+ */
+typedef struct {
+    profile_slot_t slots[PROFILE_SLOTS];
+} profile_table_t;
+
+// PROFILE_THREADS tables of their own, then the shared one
+static profile_table_t *tables;
+static unsigned tables_used;
+// Samples that found no free slot within PROFILE_PROBES
+static uint64_t dropped;
+static __thread profile_table_t *mine;
+static const char *profile_path;
+static sigset_t profile_signals;
+
+/** @brief SIGPROF handler: counts the interrupted thread's current stack
+ */
+static void profile_handler(int sig) {
+    (void) sig;
+    int saved_errno = errno;
+
+    // Each thread claims a table on its first sample; the arena is reserved up front
+    if (!mine) {
+        unsigned i = __atomic_fetch_add(&tables_used, 1, __ATOMIC_RELAXED);
+        mine = &tables[i < PROFILE_THREADS ? i : PROFILE_THREADS];
+    }
+
+    void *pcs[PROFILE_DEPTH + PROFILE_SKIP];
+    int depth = backtrace(pcs, PROFILE_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+    if (depth <= 0)
+        goto out;
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < depth; i++)
+        hash = (hash ^ (uintptr_t) pcs[PROFILE_SKIP + i]) * 1099511628211ULL;
+
+    for (int p = 0; p < PROFILE_PROBES; p++) {
+        profile_slot_t *slot = &mine->slots[(hash + p) % PROFILE_SLOTS];
+        int seen = __atomic_load_n(&slot->depth, __ATOMIC_ACQUIRE);
+        if (seen == 0
+            && __atomic_compare_exchange_n(
+                &slot->depth, &seen, -1, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            memcpy(slot->pcs, pcs + PROFILE_SKIP, depth * sizeof(void *));
+            slot->hash = hash;
+            slot->count = 1;
+            __atomic_store_n(&slot->depth, depth, __ATOMIC_RELEASE);
+            goto out;
+        }
+        if (seen == depth && slot->hash == hash
+            && !memcmp(slot->pcs, pcs + PROFILE_SKIP, depth * sizeof(void *))) {
+            __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+            goto out;
+        }
+    }
+    __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+
+out:
+    errno = saved_errno;
+}
+
+/** @brief Writes one frame's name: the symbol if the dynamic symbol table has it
+ *         (the Makefile links with -rdynamic), otherwise object+offset for addr2line
+ *
+ *  @param leaf whether pc is the interrupted instruction rather than a return address
+ */
+static void profile_frame(FILE *f, void *pc, bool leaf) {
+    // A return address points past its call, possibly into the next function
+    void *lookup = leaf ? pc : (char *) pc - 1;
+    Dl_info info;
+    bool found = dladdr(lookup, &info);
+    if (found && info.dli_sname) {
+        fputs(info.dli_sname, f);
+    } else if (found && info.dli_fname) {
+        const char *base = strrchr(info.dli_fname, '/');
+        fprintf(f, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+            (unsigned long) ((char *) pc - (char *) info.dli_fbase));
+    } else {
+        fprintf(f, "0x%lx", (unsigned long) (uintptr_t) pc);
+    }
+}
+
+/** @brief Writes every thread's stacks to profile_path as folded stacks, root first
+ */
+static void profile_dump(void) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", profile_path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "profile: cannot write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    // The shared table is in use once more threads than PROFILE_THREADS have been sampled
+    unsigned threads = __atomic_load_n(&tables_used, __ATOMIC_RELAXED);
+    if (threads > PROFILE_THREADS + 1)
+        threads = PROFILE_THREADS + 1;
+    for (unsigned t = 0; t < threads; t++) {
+        for (int s = 0; s < PROFILE_SLOTS; s++) {
+            profile_slot_t *slot = &tables[t].slots[s];
+            int depth = __atomic_load_n(&slot->depth, __ATOMIC_ACQUIRE);
+            if (depth <= 0)
+                continue;
+            fputs("httpserver", f);
+            for (int i = depth - 1; i >= 0; i--) {
+                fputc(';', f);
+                profile_frame(f, slot->pcs[i], i == 0);
+            }
+            fprintf(f, " %lu\n",
+                (unsigned long) __atomic_load_n(&slot->count, __ATOMIC_RELAXED));
+        }
+    }
+    uint64_t lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (lost)
+        fprintf(f, "httpserver;[dropped] %lu\n", (unsigned long) lost);
+
+    // Readers never see a half-written dump
+    if (fclose(f) || rename(tmp, profile_path))
+        fprintf(stderr, "profile: cannot write %s: %s\n", profile_path, strerror(errno));
+}
+
+/** @brief Waits for the dump signals, which every other thread blocks
+ */
+static void *profile_thread(void *arg) {
+    (void) arg;
+    while (1) {
+        int sig;
+        if (sigwait(&profile_signals, &sig))
+            continue;
+        profile_dump();
+        if (sig == SIGUSR2)
+            continue;
+
+        // Then die of the signal the usual way
+        sigset_t one;
+        sigemptyset(&one);
+        sigaddset(&one, sig);
+        signal(sig, SIG_DFL);
+        pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+        raise(sig);
+    }
+    return NULL;
+}
+
+int profile_init(long hz, const char *out_path) {
+    profile_path = out_path;
+
+    // Only the pages of tables that threads actually claim get backed by memory
+    tables = mmap(NULL, sizeof(profile_table_t) * (PROFILE_THREADS + 1), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (tables == MAP_FAILED)
+        return -1;
+
+    // backtrace loads libgcc on first use, which must not happen inside the handler
+    void *warm[1];
+    backtrace(warm, 1);
+
+    sigemptyset(&profile_signals);
+    sigaddset(&profile_signals, SIGUSR2);
+    sigaddset(&profile_signals, SIGINT);
+    sigaddset(&profile_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &profile_signals, NULL);
+    pthread_t tid;
+    pthread_create(&tid, NULL, profile_thread, NULL);
+    pthread_detach(tid);
+
+    struct sigaction sa = { .sa_handler = profile_handler, .sa_flags = SA_RESTART };
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL))
+        return -1;
+
+    long usec = 1000000 / hz;
+    if (usec < 1)
+        usec = 1;
+    struct itimerval it;
+    it.it_interval.tv_sec = usec / 1000000;
+    it.it_interval.tv_usec = usec % 1000000;
+    it.it_value = it.it_interval;
+    return setitimer(ITIMER_PROF, &it, NULL);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+// Default sampling rate for --profile, in samples per CPU-second. Not a round
+// number, so sampling doesn't lock step with periodic work like timer ticks.
+#define PROFILE_DEFAULT_HZ 99
+
+/** @brief Starts the sampling profiler.
+ *
+ *         setitimer(ITIMER_PROF) sends SIGPROF at hz per second of CPU time
+ *         used by the whole process, and the kernel delivers it to the thread
+ *         that is running, so busy threads are sampled in proportion to the
+ *         CPU they use. The handler takes a backtrace() and counts it in a
+ *         per-thread table that only that thread writes, without locks or
+ *         allocation.
+ *
+ *         The tables are written to out_path as folded stacks (flamegraph.pl
+ *         input, one "frame;frame;... count" line per stack) on SIGUSR2, and
+ *         on SIGINT or SIGTERM just before the server exits.
+ *
+ *         Must be called before any other thread is started, so they all
+ *         inherit the signal mask that routes those signals to the
+ *         profiler's own thread.
+ *
+ *  @param hz samples per CPU-second
+ *
+ *  @param out_path where dumps go; each dump replaces the last
+ *
+ *  @return 0 on success, -1 if the timer or handler could not be set up
+ */
+int profile_init(long hz, const char *out_path);
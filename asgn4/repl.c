@@ -0,0 +1,432 @@
+#include "repl.h"
+#include "asgn2_helper_funcs.h"
+#include "fdcache.h"
+#include "httpserver.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// Most changes handed to a follower per poll
+#define REPL_BATCH 256
+// How long GET /.changes waits for a new change
+#define REPL_POLL_MS 1000
+// Most GET /.changes waiting at once; each one holds a worker thread while it waits
+#define REPL_POLLERS_MAX 2
+// "<seq> <uri> <size> <time_ms>\n"
+#define REPL_LINE_MAX 128
+
+typedef enum { REPL_OFF, REPL_PRIMARY, REPL_FOLLOWER } repl_role_t;
+
+static repl_role_t role = REPL_OFF;
+
+// Primary: the change log, and the offset of every entry in it (seq n at offs[n - 1])
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_grew = PTHREAD_COND_INITIALIZER;
+static int log_fd = -1;
+static off_t log_end;
+static off_t *offs;
+static uint64_t offs_count, offs_cap;
+static unsigned pollers;
+
+// Follower: where the primary is and how far behind it we are
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static int primary_port;
+static uint64_t applied, primary_head, last_lag_ms;
+
+/** @brief Wall-clock milliseconds, comparable between processes on the same host
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** @brief Parses one change log line (without its newline)
+ *
+ *  @return true if it is well formed, with its URI copied to uri
+ */
+static bool repl_parse(
+    const char *line, uint64_t *seq, char uri[64], uint64_t *size, uint64_t *time_ms) {
+    char *p = NULL;
+    if (!isdigit((unsigned char) *line))
+        return false;
+    *seq = strtoull(line, &p, 10);
+    if (*p++ != ' ')
+        return false;
+    size_t len = strcspn(p, " ");
+    if (len < 1 || len > 63 || p[len] != ' ')
+        return false;
+    // Same grammar as conn_parse, so a log can't point a follower outside its directory
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char) p[i]) && p[i] != '.' && p[i] != '-')
+            return false;
+    }
+    memcpy(uri, p, len);
+    uri[len] = '\0';
+    p += len + 1;
+    if (!isdigit((unsigned char) *p))
+        return false;
+    *size = strtoull(p, &p, 10);
+    if (*p++ != ' ' || !isdigit((unsigned char) *p))
+        return false;
+    *time_ms = strtoull(p, &p, 10);
+    return *p == '\0';
+}
+
+/** @brief Remembers where the next entry starts. Must hold log_lock (or be single threaded).
+ */
+static void repl_index(off_t off) {
+    if (offs_count == offs_cap) {
+        offs_cap = offs_cap ? offs_cap * 2 : 1024;
+        offs = realloc(offs, offs_cap * sizeof(*offs));
+        if (!offs)
+            err(EXIT_FAILURE, "realloc");
+    }
+    offs[offs_count++] = off;
+}
+
+int repl_primary_init(const char *log_path) {
+    log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (log_fd < 0)
+        return -1;
+
+    // Index the existing entries. A torn last line from a crash is dropped.
+    FILE *f = fdopen(dup(log_fd), "r");
+    if (!f) {
+        close(log_fd);
+        return -1;
+    }
+    char line[REPL_LINE_MAX];
+    off_t off = 0;
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        if (line[len - 1] != '\n')
+            break;
+        line[len - 1] = '\0';
+        uint64_t seq, size, time_ms;
+        char uri[64];
+        if (!repl_parse(line, &seq, uri, &size, &time_ms) || seq != offs_count + 1) {
+            fclose(f);
+            close(log_fd);
+            errno = EINVAL;
+            return -1;
+        }
+        repl_index(off);
+        off += len;
+    }
+    fclose(f);
+    if (ftruncate(log_fd, off)) {
+        close(log_fd);
+        return -1;
+    }
+    log_end = off;
+    role = REPL_PRIMARY;
+    return 0;
+}
+
+void repl_record(const char *uri, int fd) {
+    if (role != REPL_PRIMARY)
+        return;
+    struct stat st;
+    if (fstat(fd, &st))
+        return;
+
+    pthread_mutex_lock(&log_lock);
+    char line[REPL_LINE_MAX];
+    int len = snprintf(line, sizeof(line), "%lu %s %lu %lu\n", (unsigned long) offs_count + 1,
+        uri, (unsigned long) st.st_size, (unsigned long) now_ms());
+    if (write_all(log_fd, line, len) == len) {
+        repl_index(log_end);
+        log_end += len;
+        pthread_cond_broadcast(&log_grew);
+    } else {
+        warn("change log write failed, followers will miss %s", uri);
+        ftruncate(log_fd, log_end);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+/** @brief Answers GET /.changes: a "head <seq>" line with the newest sequence number,
+ *         followed by up to REPL_BATCH change log lines after X-Since
+ */
+static void repl_serve_changes(task_t *t) {
+    char val[32];
+    uint64_t since = 0;
+    if (head_get(&t->head, "X-Since", val, sizeof(val)))
+        since = strtoull(val, NULL, 10);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPL_POLL_MS / 1000;
+
+    // Long poll, so a caught-up follower hears about a write as soon as it is logged. Past
+    // REPL_POLLERS_MAX the answer comes right away, and the follower waits on its own side.
+    pthread_mutex_lock(&log_lock);
+    if (offs_count <= since && pollers < REPL_POLLERS_MAX) {
+        pollers++;
+        while (offs_count <= since) {
+            if (pthread_cond_timedwait(&log_grew, &log_lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        pollers--;
+    }
+    uint64_t head = offs_count;
+    off_t from = 0, to = 0;
+    if (since < head) {
+        from = offs[since];
+        to = since + REPL_BATCH < head ? offs[since + REPL_BATCH] : log_end;
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    char first[32];
+    int first_len = snprintf(first, sizeof(first), "head %lu\n", (unsigned long) head);
+    uint16_t code = 200;
+    if (send_ok_header(t->connfd, first_len + to - from)
+        || write_all(t->connfd, first, first_len) != first_len
+        || sendfile_all(t->connfd, log_fd, from, to - from))
+        code = 500;
+    write_to_audit_code(t->conn, "GET", REPL_CHANGES_URI, code);
+}
+
+/** @brief Answers GET /.replica on a follower
+ */
+static void repl_serve_status(task_t *t) {
+    pthread_mutex_lock(&stat_lock);
+    uint64_t a = applied, h = primary_head, lag = last_lag_ms;
+    pthread_mutex_unlock(&stat_lock);
+
+    char body[160];
+    int body_len = snprintf(body, sizeof(body),
+        "primary %lu\napplied %lu\nbehind %lu\nlag_ms %lu\n", (unsigned long) h,
+        (unsigned long) a, (unsigned long) (h > a ? h - a : 0), (unsigned long) lag);
+    uint16_t code = 200;
+    if (send_ok_header(t->connfd, body_len) || write_all(t->connfd, body, body_len) != body_len)
+        code = 500;
+    write_to_audit_code(t->conn, "GET", REPL_STATUS_URI, code);
+}
+
+bool repl_serve(task_t *t) {
+    const char *uri = conn_get_uri(t->conn);
+    if (role == REPL_PRIMARY && !strcmp(uri, REPL_CHANGES_URI)) {
+        repl_serve_changes(t);
+        return true;
+    }
+    if (role == REPL_FOLLOWER && !strcmp(uri, REPL_STATUS_URI)) {
+        repl_serve_status(t);
+        return true;
+    }
+    return false;
+}
+
+bool repl_read_only(void) {
+    return role == REPL_FOLLOWER;
+}
+
+/** @brief Sends GET /uri to the primary and reads the response head
+ *
+ *  @param buf receives the head and possibly the start of the body
+ *
+ *  @param have set to how many body bytes are already in buf, starting at *body
+ *
+ *  @return the connected socket, or -1 on failure
+ */
+static int repl_get(const char *uri, uint64_t since, char *buf, size_t bufsize, uint16_t *code,
+    uint64_t *len, char **body, size_t *have) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    struct timeval tv = { .tv_sec = 5 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(primary_port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)))
+        goto fail;
+
+    char req[128];
+    int req_len = snprintf(
+        req, sizeof(req), "GET /%s HTTP/1.1\r\nX-Since: %lu\r\n\r\n", uri, (unsigned long) since);
+    if (write_all(sock, req, req_len) != req_len)
+        goto fail;
+
+    ssize_t n = read_until(sock, buf, bufsize - 1, "\r\n\r\n");
+    if (n <= 0)
+        goto fail;
+    buf[n] = '\0';
+    char *end = strstr(buf, "\r\n\r\n");
+    char *cl = strstr(buf, "Content-Length: ");
+    if (!end || !cl || cl > end || sscanf(buf, "HTTP/1.1 %hu ", code) != 1)
+        goto fail;
+    *len = strtoull(cl + 16, NULL, 10);
+    *body = end + 4;
+    *have = buf + n - *body;
+    if (*have > *len)
+        goto fail;
+    return sock;
+
+fail:
+    close(sock);
+    return -1;
+}
+
+/** @brief Fetches up to REPL_BATCH changes after since
+ *
+ *  @return the NUL-terminated feed (to be freed), or NULL on failure
+ */
+static char *repl_fetch_changes(uint64_t since) {
+    char buf[HEAD_MAX + 1];
+    uint16_t code;
+    uint64_t len;
+    char *start;
+    size_t have;
+    int sock = repl_get(REPL_CHANGES_URI, since, buf, sizeof(buf), &code, &len, &start, &have);
+    if (sock < 0)
+        return NULL;
+    char *feed = NULL;
+    if (code != 200 || len > (uint64_t) REPL_BATCH * REPL_LINE_MAX + 32)
+        goto out;
+    feed = malloc(len + 1);
+    if (!feed)
+        goto out;
+    memcpy(feed, start, have);
+    while (have < len) {
+        ssize_t n = read(sock, feed + have, len - have);
+        if (n <= 0) {
+            free(feed);
+            feed = NULL;
+            goto out;
+        }
+        have += n;
+    }
+    feed[len] = '\0';
+
+out:
+    close(sock);
+    return feed;
+}
+
+/** @brief Copies the primary's current contents of uri into our directory, through the same
+ *         locked write path as a PUT so local GETs never see a partial copy
+ *
+ *  @return 0 if applied (or gone on the primary), -1 to retry later
+ */
+static int repl_apply(const char *uri) {
+    char buf[HEAD_MAX + 1];
+    uint16_t code;
+    uint64_t len;
+    char *start;
+    size_t have;
+    int sock = repl_get(uri, 0, buf, sizeof(buf), &code, &len, &start, &have);
+    if (sock < 0)
+        return -1;
+    // A later change will have removed or replaced it; that entry brings us up to date
+    if (code == 404 || code == 403) {
+        close(sock);
+        return 0;
+    }
+    int ret = -1;
+    if (code != 200)
+        goto out;
+
+    bool existed;
+    const Response_t *res = NULL;
+    int fd = open_locked_for_write(uri, 0, true, &existed, &res);
+    if (fd < 0)
+        goto out;
+    struct stat st;
+    if (!ftruncate(fd, 0) && write_all(fd, start, have) == (ssize_t) have
+        && (have == len || pass_bytes(sock, fd, len - have) >= 0) && !fstat(fd, &st)
+        && (uint64_t) st.st_size == len)
+        ret = 0;
+    fdcache_invalidate(uri);
+    close(fd);
+
+out:
+    close(sock);
+    return ret;
+}
+
+/** @brief Tails the primary's change log forever, applying each change in order
+ */
+static void *repl_follower_thread(void *arg) {
+    (void) arg;
+    uint64_t since = 0;
+    while (1) {
+        uint64_t asked = now_ms();
+        char *feed = repl_fetch_changes(since);
+        unsigned long head;
+        if (!feed || sscanf(feed, "head %lu\n", &head) != 1) {
+            free(feed);
+            sleep(1);
+            continue;
+        }
+        // The primary's log was reset: start over from its first change
+        if (head < since)
+            since = 0;
+        pthread_mutex_lock(&stat_lock);
+        primary_head = head;
+        applied = since;
+        pthread_mutex_unlock(&stat_lock);
+
+        uint64_t seqs[REPL_BATCH], times[REPL_BATCH];
+        char uris[REPL_BATCH][64];
+        size_t count = 0;
+        // A feed that is just the head line (or less) has no changes
+        char *line = strchr(feed, '\n');
+        line = line ? line + 1 : feed + strlen(feed);
+        for (char *nl; count < REPL_BATCH && (nl = strchr(line, '\n')); line = nl + 1) {
+            *nl = '\0';
+            uint64_t size;
+            if (!repl_parse(line, &seqs[count], uris[count], &size, &times[count])
+                || seqs[count] != since + count + 1)
+                break;
+            count++;
+        }
+        if (count == 0 && head > since)
+            sleep(1);
+        // Caught up, and the primary had too many polls waiting to make this one wait
+        uint64_t waited = now_ms() - asked;
+        if (count == 0 && head <= since && waited < REPL_POLL_MS)
+            usleep((REPL_POLL_MS - waited) * 1000);
+
+        for (size_t i = 0; i < count; i++) {
+            // Every fetch gets the newest contents, so only the last change to a URI matters
+            bool later = false;
+            for (size_t j = i + 1; j < count && !later; j++)
+                later = !strcmp(uris[i], uris[j]);
+            if (!later && repl_apply(uris[i])) {
+                sleep(1);
+                break;
+            }
+            since = seqs[i];
+            pthread_mutex_lock(&stat_lock);
+            applied = since;
+            uint64_t now = now_ms();
+            last_lag_ms = now > times[i] ? now - times[i] : 0;
+            pthread_mutex_unlock(&stat_lock);
+        }
+        free(feed);
+    }
+    return NULL;
+}
+
+void repl_follower_init(int port) {
+    primary_port = port;
+    role = REPL_FOLLOWER;
+    pthread_t tid;
+    pthread_create(&tid, NULL, repl_follower_thread, NULL);
+    pthread_detach(tid);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "task.h"
+
+#include <stdbool.h>
+
+// Change-log feed served by a primary
+#define REPL_CHANGES_URI ".changes"
+// Replication status served by a follower
+#define REPL_STATUS_URI ".replica"
+
+/** @brief Turns this server into a primary that records every successful write
+ *         in a change log and serves it to followers at GET /.changes.
+ *
+ *         Existing entries in the log are kept, so sequence numbers (the
+ *         version of each change) keep growing across restarts.
+ *
+ *  @param log_path the change log, created if missing
+ *
+ *  @return 0 on success, -1 if the log can't be opened or is corrupt
+ */
+int repl_primary_init(const char *log_path);
+
+/** @brief Turns this server into a read-only follower of the primary
+ *         listening on 127.0.0.1:port, and starts the thread that tails its
+ *         change log.
+ */
+void repl_follower_init(int port);
+
+/** @brief Whether this server is a follower and must reject writes
+ */
+bool repl_read_only(void);
+
+/** @brief Appends a change for uri to the log if this server is a primary.
+ *
+ *         Must be called while still holding the exclusive flock on fd, so
+ *         the log order is the order the writes were applied in.
+ *
+ *  @param fd the written file, used for its new size
+ */
+void repl_record(const char *uri, int fd);
+
+/** @brief Serves GET requests for the replication endpoints.
+ *
+ *         A primary answers GET /.changes with the changes after the
+ *         sequence number in its X-Since header. It waits up to a second
+ *         for one if there are none yet. A follower answers GET /.replica
+ *         with how far behind the primary it is.
+ *
+ *  @return false if the request is not for one of them
+ */
+bool repl_serve(task_t *t);
@@ -0,0 +1,405 @@
+// Replays an httpserver audit log against a running server and reports latency percentiles
+// and status mismatches.
+//
+// usage: replay [-c clients] [-r requests_per_s] [-b put_bytes] [-a] port audit_log
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USAGE "usage: %s [-c clients] [-r requests_per_s] [-b put_bytes] [-a] port audit_log\n"
+
+// Mismatched requests listed individually; the rest are only counted
+#define REPLAY_SHOW_MISMATCHES 10
+// Rows of the GET /.allocs table that are read
+#define REPLAY_ALLOC_ROWS 16
+
+typedef enum { OP_GET, OP_PUT, OP_POST, OP_KINDS } op_kind_t;
+
+static const char *op_names[OP_KINDS] = { "GET", "PUT", "POST" };
+
+typedef struct {
+    op_kind_t kind;
+    char uri[64];
+    char rid[32];
+    uint16_t expected;
+    // Line in the audit log, for the mismatch report
+    size_t line;
+    // Filled in by the replay: status 0 means no response at all
+    uint16_t status;
+    uint64_t latency_ns;
+} op_t;
+
+// One phase's row of GET /.allocs
+typedef struct {
+    char phase[16];
+    uint64_t requests;
+    uint64_t allocs;
+    // Allocations per request allowed, or 0 if the phase has no budget
+    int budget;
+} alloc_row_t;
+
+static op_t *ops;
+static size_t op_count;
+static size_t next_op;
+static uint16_t port;
+static double rate;
+static char *body;
+static size_t body_len;
+static uint64_t start_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** @brief Parses one "method,uri,code,request-id" audit line. Methods without a replayable
+ *         request (PATCH needs a range, UNSUPPORTED has nothing to send) and the server's own
+ *         dot-URIs (.batch, .changes, ...) are skipped.
+ *
+ *  @return true if line was turned into op
+ */
+static bool replay_parse(char *line, op_t *op) {
+    char *method = strsep(&line, ",");
+    char *uri = strsep(&line, ",");
+    char *code = strsep(&line, ",");
+    char *rid = strsep(&line, "\r\n");
+    if (!method || !uri || !code || !rid || !uri[0] || uri[0] == '.' || strlen(uri) > 63
+        || strlen(rid) >= sizeof(op->rid))
+        return false;
+
+    int kind = 0;
+    while (kind < OP_KINDS && strcmp(method, op_names[kind]))
+        kind++;
+    if (kind == OP_KINDS)
+        return false;
+
+    char *end = NULL;
+    long status = strtol(code, &end, 10);
+    if (*end != '\0' || status < 100 || status > 599)
+        return false;
+
+    memset(op, 0, sizeof(*op));
+    op->kind = kind;
+    op->expected = status;
+    strcpy(op->uri, uri);
+    // "0" is what the server logs when there was no Request-Id
+    if (strcmp(rid, "0"))
+        strcpy(op->rid, rid);
+    return true;
+}
+
+/** @brief Connects to the server on localhost
+ *
+ *  @return the connected socket, or -1
+ */
+static int replay_connect(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** @brief Sends one request and reads the response to the end (the server closes every
+ *         connection after answering)
+ *
+ *  @return the response status, or 0 if there was none
+ */
+static uint16_t replay_send(const op_t *op) {
+    int fd = replay_connect();
+    if (fd < 0)
+        return 0;
+
+    char head[256];
+    int len = snprintf(head, sizeof(head), "%s /%s HTTP/1.1\r\n", op_names[op->kind], op->uri);
+    if (op->rid[0])
+        len += snprintf(head + len, sizeof(head) - len, "Request-Id: %s\r\n", op->rid);
+    if (op->kind != OP_GET)
+        len += snprintf(head + len, sizeof(head) - len, "Content-Length: %zu\r\n", body_len);
+    len += snprintf(head + len, sizeof(head) - len, "\r\n");
+
+    struct iovec iov[2] = { { head, len }, { body, op->kind == OP_GET ? 0 : body_len } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    while (iov[0].iov_len || iov[1].iov_len) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        for (int i = 0; i < 2; i++) {
+            size_t used = (size_t) n < iov[i].iov_len ? (size_t) n : iov[i].iov_len;
+            iov[i].iov_base = (char *) iov[i].iov_base + used;
+            iov[i].iov_len -= used;
+            n -= used;
+        }
+    }
+
+    // Keep the status line, throw the rest away
+    char buf[65536], status_line[16] = { 0 };
+    size_t got = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0 && got < sizeof(status_line) - 1) {
+            size_t take = sizeof(status_line) - 1 - got;
+            memcpy(status_line + got, buf, (size_t) n < take ? (size_t) n : take);
+        }
+        got += n > 0 ? n : 0;
+    }
+    close(fd);
+
+    unsigned code = 0;
+    if (sscanf(status_line, "HTTP/1.1 %3u", &code) != 1)
+        return 0;
+    return code;
+}
+
+/** @brief One client: takes the next request in log order until there are none left
+ */
+static void *replay_client(void *arg) {
+    (void) arg;
+    while (1) {
+        size_t i = __atomic_fetch_add(&next_op, 1, __ATOMIC_RELAXED);
+        if (i >= op_count)
+            break;
+
+        // At a fixed rate, latency counts from when the request was due, not when a client
+        // got around to it, so a stalled server can't hide its backlog
+        uint64_t due = start_ns + (rate > 0 ? (uint64_t) (i * (1e9 / rate)) : 0);
+        if (rate > 0) {
+            struct timespec ts = { due / 1000000000, due % 1000000000 };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            }
+        } else {
+            due = now_ns();
+        }
+        ops[i].status = replay_send(&ops[i]);
+        ops[i].latency_ns = now_ns() - due;
+    }
+    return NULL;
+}
+
+/** @brief Fetches GET /.allocs and reads its per-phase table, which ends at the first blank
+ *         line. The counts are totals since the server started.
+ *
+ *  @return the number of rows read into rows, or -1 if the server didn't serve the page (it
+ *          wasn't built with ALLOC_STATS=1)
+ */
+static int replay_allocs(alloc_row_t *rows) {
+    int fd = replay_connect();
+    if (fd < 0)
+        return -1;
+    const char *req = "GET /.allocs HTTP/1.1\r\n\r\n";
+    if (send(fd, req, strlen(req), MSG_NOSIGNAL) != (ssize_t) strlen(req)) {
+        close(fd);
+        return -1;
+    }
+    char buf[16384];
+    size_t got = 0;
+    ssize_t n;
+    while (got < sizeof(buf) - 1
+           && ((n = read(fd, buf + got, sizeof(buf) - 1 - got)) > 0 || (n < 0 && errno == EINTR)))
+        got += n > 0 ? n : 0;
+    close(fd);
+    buf[got] = '\0';
+
+    unsigned code = 0;
+    char *page = strstr(buf, "\r\n\r\n");
+    if (sscanf(buf, "HTTP/1.1 %3u", &code) != 1 || code != 200 || !page)
+        return -1;
+    // Skip the column names
+    char *line = strchr(page + 4, '\n');
+    int count = 0;
+    while (line && line[1] != '\n' && count < REPLAY_ALLOC_ROWS) {
+        alloc_row_t *r = &rows[count];
+        r->budget = 0;
+        if (sscanf(line + 1, "%15s %" SCNu64 " %" SCNu64 " %*f %*f %*f %d", r->phase, &r->requests,
+                &r->allocs, &r->budget)
+            < 3)
+            return -1;
+        count++;
+        line = strchr(line + 1, '\n');
+    }
+    return count;
+}
+
+/** @brief Prints the allocations per request of each budgeted phase during the replay, from the
+ *         GET /.allocs tables before and after it
+ *
+ *  @return true if every phase stayed within its budget
+ */
+static bool replay_report_allocs(const alloc_row_t *before, const alloc_row_t *after, int rows) {
+    bool ok = true;
+    printf("%-6s %10s %10s %10s %6s\n", "phase", "requests", "allocs", "allocs/req", "budget");
+    for (int i = 0; i < rows; i++) {
+        if (!after[i].budget)
+            continue;
+        uint64_t requests = after[i].requests - before[i].requests;
+        uint64_t allocs = after[i].allocs - before[i].allocs;
+        bool within = !requests || (double) allocs / requests <= after[i].budget;
+        ok &= within;
+        printf("%-6s %10" PRIu64 " %10" PRIu64 " %10.2f %6d %s\n", after[i].phase, requests,
+            allocs, requests ? (double) allocs / requests : 0, after[i].budget,
+            within ? "ok" : "OVER");
+    }
+    return ok;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/** @brief Prints one row of the latency table for the requests of a kind (or all, if kind is
+ *         OP_KINDS)
+ */
+static void replay_report_row(op_kind_t kind, uint64_t *lat) {
+    size_t n = 0;
+    for (size_t i = 0; i < op_count; i++) {
+        if (kind == OP_KINDS || ops[i].kind == kind)
+            lat[n++] = ops[i].latency_ns;
+    }
+    if (!n)
+        return;
+    qsort(lat, n, sizeof(uint64_t), compare_u64);
+
+    static const double pcts[] = { 50, 90, 99, 99.9 };
+    printf("%-6s %8zu", kind == OP_KINDS ? "all" : op_names[kind], n);
+    for (size_t p = 0; p < sizeof(pcts) / sizeof(pcts[0]); p++) {
+        // Nearest rank
+        size_t rank = (size_t) (pcts[p] / 100 * n + 0.999999);
+        printf(" %9.3f", lat[(rank ? rank : 1) - 1] / 1e6);
+    }
+    printf(" %9.3f\n", lat[n - 1] / 1e6);
+}
+
+int main(int argc, char **argv) {
+    long clients = 1;
+    long put_bytes = 4096;
+    bool check_allocs = false;
+    int c;
+    char *end = NULL;
+    while ((c = getopt(argc, argv, "c:r:b:a")) != -1) {
+        switch (c) {
+        case 'c':
+            clients = strtol(optarg, &end, 10);
+            if (*end != '\0' || clients <= 0)
+                errx(EXIT_FAILURE, "invalid number of clients: %s", optarg);
+            break;
+        case 'r':
+            rate = strtod(optarg, &end);
+            if (*end != '\0' || rate <= 0)
+                errx(EXIT_FAILURE, "invalid rate: %s", optarg);
+            break;
+        case 'b':
+            put_bytes = strtol(optarg, &end, 10);
+            if (*end != '\0' || put_bytes < 0)
+                errx(EXIT_FAILURE, "invalid body size: %s", optarg);
+            break;
+        case 'a': check_allocs = true; break;
+        default: fprintf(stderr, USAGE, argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    long p = strtol(argv[optind], &end, 10);
+    if (*end != '\0' || p <= 0 || p > 65535)
+        errx(EXIT_FAILURE, "invalid port number: %s", argv[optind]);
+    port = p;
+
+    FILE *log = fopen(argv[optind + 1], "r");
+    if (!log)
+        err(EXIT_FAILURE, "%s", argv[optind + 1]);
+    size_t cap = 1024, skipped = 0;
+    ops = malloc(cap * sizeof(op_t));
+    char *line = NULL;
+    size_t line_cap = 0, line_no = 0;
+    while (getline(&line, &line_cap, log) > 0) {
+        line_no++;
+        if (op_count == cap) {
+            cap *= 2;
+            ops = realloc(ops, cap * sizeof(op_t));
+        }
+        if (replay_parse(line, &ops[op_count]))
+            ops[op_count++].line = line_no;
+        else
+            skipped++;
+    }
+    free(line);
+    fclose(log);
+    if (!op_count)
+        errx(EXIT_FAILURE, "no requests to replay in %s", argv[optind + 1]);
+
+    // Every PUT and POST sends the same generated body
+    body_len = put_bytes;
+    body = malloc(body_len + 1);
+    for (size_t i = 0; i < body_len; i++)
+        body[i] = 'a' + i % 26;
+
+    // The page counts from server start, so only the difference belongs to the replay
+    alloc_row_t allocs_before[REPLAY_ALLOC_ROWS], allocs_after[REPLAY_ALLOC_ROWS];
+    int alloc_rows = 0;
+    if (check_allocs && (alloc_rows = replay_allocs(allocs_before)) < 0)
+        errx(EXIT_FAILURE, "GET /.allocs failed; -a needs a server built with ALLOC_STATS=1");
+
+    pthread_t *tids = calloc(clients, sizeof(pthread_t));
+    start_ns = now_ns();
+    for (long i = 0; i < clients; i++)
+        pthread_create(&tids[i], NULL, replay_client, NULL);
+    for (long i = 0; i < clients; i++)
+        pthread_join(tids[i], NULL);
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    printf("replayed %zu requests (%zu lines skipped) with %ld clients in %.3f s: %.1f req/s\n",
+        op_count, skipped, clients, elapsed, op_count / elapsed);
+    printf("%-6s %8s %9s %9s %9s %9s %9s   (ms)\n", "", "count", "p50", "p90", "p99", "p99.9",
+        "max");
+    uint64_t *lat = malloc(op_count * sizeof(uint64_t));
+    for (int k = 0; k <= OP_KINDS; k++)
+        replay_report_row(k, lat);
+    free(lat);
+
+    size_t mismatches = 0, failures = 0;
+    for (size_t i = 0; i < op_count; i++) {
+        if (!ops[i].status)
+            failures++;
+        if (ops[i].status == ops[i].expected)
+            continue;
+        if (mismatches++ < REPLAY_SHOW_MISMATCHES)
+            printf("  line %zu: %s /%s expected %u, got %u\n", ops[i].line, op_names[ops[i].kind],
+                ops[i].uri, ops[i].expected, ops[i].status);
+    }
+    printf("status mismatches: %zu, no response: %zu\n", mismatches, failures);
+
+    bool within_budget = true;
+    if (check_allocs) {
+        if (replay_allocs(allocs_after) != alloc_rows)
+            errx(EXIT_FAILURE, "GET /.allocs failed after the replay");
+        within_budget = replay_report_allocs(allocs_before, allocs_after, alloc_rows);
+    }
+
+    free(tids);
+    free(body);
+    free(ops);
+    return mismatches ? 2 : !within_budget ? 3 : EXIT_SUCCESS;
+}
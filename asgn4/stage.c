@@ -0,0 +1,75 @@
+#include "stage.h"
+#include "httpserver.h"
+#include "task.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static queue_t *net_queue;
+static queue_t *disk_queue;
+
+/** @brief Network stage: receives the whole request, then hands it to the disk stage
+ */
+static void *stage_net_worker(void *arg) {
+    (void) arg;
+    accepted_t *a;
+    while (1) {
+        queue_pop(net_queue, (void **) &a);
+        int connfd = a->connfd;
+        task_t *t = task_new(connfd, a->seq);
+        free(a);
+        if (!t) {
+            send_status(connfd, 500, "Internal Server Error");
+            close(connfd);
+            continue;
+        }
+        // Don't spool a body that is going to be refused anyway
+        if (!t->res && expect_rejected(t)) {
+            task_delete(&t);
+            close(connfd);
+            continue;
+        }
+        if (!t->res && conn_get_request(t->conn) != &REQUEST_GET
+            && conn_get_header(t->conn, "Content-Length"))
+            t->res = task_spool_body(t);
+
+        // Requests that failed on the wire never reach a disk worker
+        if (t->res) {
+            handle_task(t);
+            task_delete(&t);
+            close(connfd);
+            continue;
+        }
+        queue_push(disk_queue, t);
+    }
+    return NULL;
+}
+
+/** @brief Disk stage: serves fully received requests
+ */
+static void *stage_disk_worker(void *arg) {
+    (void) arg;
+    task_t *t;
+    while (1) {
+        queue_pop(disk_queue, (void **) &t);
+        int connfd = t->connfd;
+        handle_task(t);
+        task_delete(&t);
+        close(connfd);
+    }
+    return NULL;
+}
+
+/** @brief Starts the staged pipeline (see stage.h)
+ */
+void stage_init(queue_t *conn_queue, size_t net_threads, size_t disk_threads) {
+    net_queue = conn_queue;
+    disk_queue = queue_new(disk_threads);
+
+    pthread_t tid;
+    for (size_t i = 0; i < net_threads; i++)
+        pthread_create(&tid, NULL, stage_net_worker, NULL);
+    for (size_t i = 0; i < disk_threads; i++)
+        pthread_create(&tid, NULL, stage_disk_worker, NULL);
+}
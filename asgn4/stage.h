@@ -0,0 +1,29 @@
+#pragma once
+
+#include "queue.h"
+
+#include <stddef.h>
+
+/** @brief Starts the staged (SEDA-style) pipeline in place of the single
+ *         worker pool.
+ *
+ *         Network stage: net_threads threads pop accepted sockets off
+ *         conn_queue, parse the request and fully receive any body into a
+ *         spool with task_spool_body (memory, up to a global budget,
+ *         otherwise an unlinked file in the spool directory). Slow or
+ *         stalled uploads only ever tie up a cheap network thread.
+ *
+ *         Disk stage: disk_threads threads pop fully received tasks off a
+ *         bounded queue of their own and run the normal handlers, so they
+ *         never wait on a client for request bytes.
+ *
+ *         Both queues are bounded: a full disk queue blocks the network
+ *         stage, which in turn stops draining conn_queue and blocks accept.
+ *
+ *  @param conn_queue queue of accepted sockets the network stage pops from
+ *
+ *  @param net_threads number of network stage threads
+ *
+ *  @param disk_threads number of disk stage threads
+ */
+void stage_init(queue_t *conn_queue, size_t net_threads, size_t disk_threads);
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "task.h"
+#include "alloc.h"
+#include "asgn2_helper_funcs.h"
+#include "deadline.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bodies up to this size are spooled in memory...
+#define SPOOL_MEM_ITEM (1024 * 1024)
+// ...as long as all in-memory spools together stay under this budget
+#define SPOOL_MEM_BUDGET (64 * 1024 * 1024)
+// Longest task_discard_body keeps reading
+#define DISCARD_MS 1000
+
+static const char *spool_dir = P_tmpdir;
+static size_t spool_mem_used;
+
+/** @brief Sets the directory used for bodies that do not fit in memory
+ */
+void task_set_spool_dir(const char *dir) {
+    spool_dir = dir;
+}
+
+/** @brief Peeks at and parses the request waiting on connfd
+ *
+ *  @return a new task_t, or NULL if out of memory
+ */
+task_t *task_new(int connfd, uint64_t seq) {
+    alloc_phase(ALLOC_PHASE_RECV);
+    task_t *t = calloc(1, sizeof(task_t));
+    if (!t) {
+        alloc_phase(ALLOC_PHASE_NONE);
+        return NULL;
+    }
+    t->connfd = connfd;
+    t->spool = -1;
+    t->seq = seq;
+    deadline_bind(t);
+
+    // The idle deadline runs until the first byte, the header deadline from there on
+    if (deadline_enabled()) {
+        char c;
+        deadline_start(t, DEADLINE_IDLE);
+        recv(connfd, &c, 1, MSG_PEEK);
+        deadline_start(t, DEADLINE_HEADER);
+    }
+
+    // Look at the raw head first; conn_parse folds every method but GET/PUT into UNSUPPORTED
+    head_peek(connfd, &t->head);
+
+    t->conn = conn_new(connfd);
+    t->res = conn_parse(t->conn);
+    deadline_stop(t);
+
+    char expect[32];
+    t->expect_continue = head_get(&t->head, "Expect", expect, sizeof(expect))
+                         && !strcasecmp(expect, "100-continue");
+    return t;
+}
+
+/** @brief Sends the interim 100 Continue response, once
+ */
+void task_continue(task_t *t) {
+    static char msg[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (!t->expect_continue || t->continued)
+        return;
+    t->continued = true;
+    write_all(t->connfd, msg, sizeof(msg) - 1);
+}
+
+/** @brief Deletes a task, its conn_t and its spool
+ */
+void task_delete(task_t **t) {
+    if (!t || !*t)
+        return;
+    deadline_stop(*t);
+    deadline_bind(NULL);
+    conn_delete(&(*t)->conn);
+    if ((*t)->spool >= 0)
+        close((*t)->spool);
+    if ((*t)->spool_in_memory)
+        __atomic_sub_fetch(&spool_mem_used, (*t)->spool_size, __ATOMIC_RELAXED);
+    free(*t);
+    *t = NULL;
+    alloc_phase(ALLOC_PHASE_NONE);
+}
+
+/** @brief Opens an anonymous spool for a body of len bytes, in memory if the
+ *         budget allows it and as an unlinked file in spool_dir otherwise
+ *
+ *  @return the spool fd, or -1
+ */
+static int task_spool_open(uint64_t len, bool *in_memory) {
+    *in_memory = false;
+    if (len <= SPOOL_MEM_ITEM) {
+        size_t used = __atomic_add_fetch(&spool_mem_used, len, __ATOMIC_RELAXED);
+        if (used <= SPOOL_MEM_BUDGET) {
+            int fd = memfd_create("spool", 0);
+            if (fd >= 0) {
+                *in_memory = true;
+                return fd;
+            }
+        }
+        __atomic_sub_fetch(&spool_mem_used, len, __ATOMIC_RELAXED);
+    }
+
+    int fd = open(spool_dir, O_TMPFILE | O_RDWR, 0600);
+    if (fd >= 0)
+        return fd;
+    // Not every file system supports O_TMPFILE
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/spool.XXXXXX", spool_dir);
+    fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+    return fd;
+}
+
+/** @brief Receives the body straight off the connection into fd, under the body deadline.
+ *         conn_recv_file takes the end of stream a deadline causes for a complete body,
+ *         so a timed-out receive is failed here.
+ *
+ *  @return NULL on success, otherwise the response to send
+ */
+static const Response_t *task_recv_conn(task_t *t, int fd) {
+    task_continue(t);
+    deadline_start(t, DEADLINE_BODY);
+    const Response_t *res = conn_recv_file(t->conn, fd);
+    deadline_stop(t);
+    if (deadline_answer(t))
+        res = &RESPONSE_BAD_REQUEST;
+    return res;
+}
+
+/** @brief Fully receives the request body into a spool
+ *
+ *  @return NULL on success, otherwise the response to send
+ */
+const Response_t *task_spool_body(task_t *t) {
+    if (t->spool >= 0)
+        return NULL;
+    char *cl = conn_get_header(t->conn, "Content-Length");
+    if (!cl)
+        return &RESPONSE_BAD_REQUEST;
+    uint64_t len = strtoull(cl, NULL, 10);
+    bool in_memory;
+    int fd = task_spool_open(len, &in_memory);
+    if (fd < 0)
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+
+    const Response_t *res = task_recv_conn(t, fd);
+    if (res) {
+        if (in_memory)
+            __atomic_sub_fetch(&spool_mem_used, len, __ATOMIC_RELAXED);
+        close(fd);
+        return res;
+    }
+    t->spool = fd;
+    t->spool_size = len;
+    t->spool_in_memory = in_memory;
+    return NULL;
+}
+
+/** @brief Writes the request body into fd
+ *
+ *  @return NULL on success, otherwise the response to send
+ */
+const Response_t *task_recv_body(task_t *t, int fd) {
+    if (t->spool < 0)
+        return task_recv_conn(t, fd);
+
+    if (lseek(t->spool, 0, SEEK_SET) < 0)
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+    // pass_bytes only reports the size of its last chunk, so just check for errors
+    if (t->spool_size && pass_bytes(t->spool, fd, t->spool_size) < 0)
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+    return NULL;
+}
+
+/** @brief Throws away the rest of a body that won't be read (see task.h)
+ */
+void task_discard_body(task_t *t) {
+    // Already spooled, or the client is still waiting for 100 Continue and never sent it
+    if (t->spool >= 0 || (t->expect_continue && !t->continued))
+        return;
+    shutdown(t->connfd, SHUT_WR);
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char buf[4096];
+    int left = DISCARD_MS;
+    struct pollfd pfd = { .fd = t->connfd, .events = POLLIN };
+    while (left > 0 && poll(&pfd, 1, left) > 0 && recv(t->connfd, buf, sizeof(buf), 0) > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = DISCARD_MS - (int) ((now.tv_sec - start.tv_sec) * 1000
+                                   + (now.tv_nsec - start.tv_nsec) / 1000000);
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "connection.h"
+#include "head.h"
+#include "wheel.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Phases of a request that can time out (see deadline.h)
+typedef enum {
+    DEADLINE_NONE,
+    DEADLINE_IDLE,
+    DEADLINE_HEADER,
+    DEADLINE_BODY,
+    DEADLINE_WRITE,
+    DEADLINE_KINDS
+} deadline_kind_t;
+
+/** @struct task_t
+ *
+ *  @brief Everything a handler needs to serve one request. A task is built
+ *         from an accepted socket by task_new and either handled right away
+ *         by a worker or, in staged mode, has its body spooled by the network
+ *         stage before being handed to a disk worker.
+ */
+typedef struct {
+    int connfd;
+    conn_t *conn;
+    // Non-NULL if conn_parse rejected the request
+    const Response_t *res;
+    head_t head;
+    // Body already received by the network stage, or -1 to read it from conn
+    int spool;
+    uint64_t spool_size;
+    bool spool_in_memory;
+    // Arrival order, stamped when the connection was accepted
+    uint64_t seq;
+    // The phase deadline currently armed, and the one that expired (if any)
+    wheel_timer_t timer;
+    deadline_kind_t deadline;
+    deadline_kind_t timed_out;
+    bool timeout_answered;
+    // The client sent "Expect: 100-continue", and whether it has been told to go ahead
+    bool expect_continue;
+    bool continued;
+} task_t;
+
+/** @struct accepted_t
+ *
+ *  @brief A connection on its way from an accept loop to a worker, with its
+ *         place in arrival order
+ */
+typedef struct {
+    int connfd;
+    uint64_t seq;
+} accepted_t;
+
+/** @brief Sets the directory used for bodies that do not fit in memory
+ */
+void task_set_spool_dir(const char *dir);
+
+/** @brief Peeks at and parses the request waiting on connfd
+ *
+ *  @param connfd the accepted client socket (not owned by the task)
+ *
+ *  @param seq the connection's place in arrival order
+ *
+ *  @return a new task_t, or NULL if out of memory (nothing has been read)
+ */
+task_t *task_new(int connfd, uint64_t seq);
+
+/** @brief Tells a client that sent Expect: 100-continue to go ahead and send the body.
+ *         Called before any body is read; only the first call sends anything.
+ */
+void task_continue(task_t *t);
+
+/** @brief Deletes a task, its conn_t and its spool. Sets *t to NULL.
+ */
+void task_delete(task_t **t);
+
+/** @brief Fully receives the request body (per Content-Length) into a spool:
+ *         a memfd while the global in-memory budget allows, otherwise an
+ *         unlinked file in the spool directory. Does nothing if the body is
+ *         already spooled.
+ *
+ *  @return NULL on success, otherwise the response to send
+ */
+const Response_t *task_spool_body(task_t *t);
+
+/** @brief Writes the request body into fd, either from the spool or straight
+ *         off the connection, starting at fd's current offset.
+ *
+ *  @return NULL on success, otherwise the response to send
+ */
+const Response_t *task_recv_body(task_t *t, int fd);
+
+/** @brief For a request answered without reading all of its body: stops sending and reads
+ *         and throws away what the client is still sending, for up to a second, so that
+ *         closing the socket with unread data doesn't reset the connection before the client
+ *         has read the response. Does nothing if no body is on its way.
+ */
+void task_discard_body(task_t *t);
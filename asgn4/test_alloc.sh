@@ -0,0 +1,47 @@
+#!/bin/sh
+# Checks a server built with ALLOC_STATS=1 against the ALLOC_BUDGET_* limits in alloc.h. Runs
+# PUTs, GETs and a 404 through the server, plain and with -S, and fails unless GET /.allocs
+# reports every budgeted phase within its budget.
+#
+# usage: ./test_alloc.sh [port]    (uses port and port + 1)
+#
+# The port defaults to one picked from the script's pid: the server's listener does not set
+# SO_REUSEADDR, so a fixed one stays busy for a minute after each run.
+
+port=${1:-$((20000 + $$ % 20000))}
+requests=20
+
+dir=$(mktemp -d)
+server=$(pwd)/httpserver
+trap 'kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+
+fails=0
+for mode in "" -S; do
+    (cd "$dir" && exec "$server" $mode -t 4 "$port" 2>/dev/null) &
+    pid=$!
+    sleep 0.3
+    if ! kill -0 $pid 2>/dev/null; then
+        echo "test_alloc: FAILED, httpserver did not start on port $port"
+        exit 1
+    fi
+    for i in $(seq $requests); do
+        curl -s -o /dev/null -X PUT --data "object $i" "http://localhost:$port/obj$i"
+        curl -s -o /dev/null "http://localhost:$port/obj$i"
+    done
+    curl -s -o /dev/null "http://localhost:$port/missing"
+    allocs=$(curl -s "http://localhost:$port/.allocs")
+    kill $pid
+    wait $pid 2>/dev/null
+    if ! echo "$allocs" | grep -q "^budget ok$"; then
+        echo "httpserver $mode: allocations over budget, or no ALLOC_STATS build"
+        echo "$allocs" | sed '/^$/q'
+        fails=$((fails + 1))
+    fi
+    # The last server's port may not be free yet
+    port=$((port + 1))
+done
+if [ $fails -ne 0 ]; then
+    echo "test_alloc: FAILED"
+    exit 1
+fi
+echo "test_alloc: PASSED"
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Checks that with -S, concurrent GETs of one URI are answered from one read. A client holds an
+# exclusive flock on the object, so the first GET blocks in its read and the others attach to
+# its flight. Once the lock drops, the server's read byte count (rchar in /proc/<pid>/io) must
+# grow by the object once, not once per request, and every client must get the object.
+#
+# usage: ./test_flight.sh [port]
+#
+# The port defaults to one picked from the script's pid: the server's listener does not set
+# SO_REUSEADDR, so a fixed one stays busy for a minute after each run.
+
+port=${1:-$((20000 + $$ % 20000))}
+clients=8
+size=524288
+
+dir=$(mktemp -d)
+out=$(mktemp -d)
+head -c $size /dev/urandom >"$dir/obj"
+server=$(pwd)/httpserver
+(cd "$dir" && exec "$server" -S -t $clients "$port" 2>/dev/null) &
+pid=$!
+trap 'kill $pid 2>/dev/null; rm -rf "$dir" "$out"' EXIT
+sleep 0.3
+if ! kill -0 $pid 2>/dev/null; then
+    echo "test_flight: FAILED, httpserver did not start on port $port"
+    exit 1
+fi
+
+rchar() {
+    awk '/^rchar/ { print $2 }' "/proc/$pid/io"
+}
+
+before=$(rchar)
+flock "$dir/obj" sleep 1 &
+sleep 0.1
+curls=""
+for i in $(seq $clients); do
+    curl -s -o "$out/$i" "http://localhost:$port/obj" &
+    curls="$curls $!"
+done
+wait $curls
+after=$(rchar)
+
+fails=0
+for i in $(seq $clients); do
+    if ! cmp -s "$dir/obj" "$out/$i"; then
+        echo "client $i: wrong contents"
+        fails=$((fails + 1))
+    fi
+done
+# One read of the object, plus the request heads
+if [ $((after - before)) -ge $((2 * size)) ]; then
+    echo "read $((after - before)) bytes for $clients GETs of a $size byte object"
+    fails=$((fails + 1))
+fi
+if [ $fails -ne 0 ]; then
+    echo "test_flight: FAILED"
+    exit 1
+fi
+echo "test_flight: PASSED"
@@ -0,0 +1,44 @@
+#include "uds.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/** @brief Initializes a listener socket on a Unix domain stream socket
+ *
+ *  @return 0 on success, -1 on failure
+ */
+int uds_listener_init(Listener_Socket *sock, const char *path, mode_t mode) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Clear out a socket from a previous run, but never anything else
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || chmod(path, mode)
+        || listen(fd, 128)) {
+        close(fd);
+        return -1;
+    }
+    sock->fd = fd;
+    return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "asgn2_helper_funcs.h"
+
+#include <sys/types.h>
+
+/** @brief Initializes a listener socket on a Unix domain (AF_UNIX) stream
+ *         socket instead of a TCP port. The result is used with
+ *         listener_accept exactly like a TCP Listener_Socket.
+ *
+ *         A stale socket left at path by a previous run is removed first;
+ *         any other kind of file at path is left alone and is an error.
+ *
+ *  @param sock The Listener_Socket to initialize.
+ *
+ *  @param path The file system path to bind to.
+ *
+ *  @param mode Permissions to give the socket file (e.g. 0660).
+ *
+ *  @return 0, indicating success, or -1, indicating that it failed to
+ *          listen.
+ */
+int uds_listener_init(Listener_Socket *sock, const char *path, mode_t mode);
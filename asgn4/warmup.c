@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include "warmup.h"
+#include "layout.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    char uri[64];
+    double score;
+} warm_entry_t;
+
+typedef struct {
+    FILE *log;
+    size_t budget;
+    warm_entry_t *table;
+    size_t capacity;
+    size_t count;
+} warmup_t;
+
+/** @brief FNV-1a hash of a URI
+ */
+static size_t warmup_hash(const char *uri) {
+    size_t h = 14695981039346656037ULL;
+    for (; *uri; uri++)
+        h = (h ^ (unsigned char) *uri) * 1099511628211ULL;
+    return h;
+}
+
+/** @brief Doubles the open-addressing table
+ *
+ *  @return false if out of memory, with the table unchanged
+ */
+static bool warmup_grow(warmup_t *w) {
+    warm_entry_t *old = w->table;
+    size_t old_cap = w->capacity;
+    size_t capacity = old_cap ? old_cap * 2 : 1024;
+    warm_entry_t *table = calloc(capacity, sizeof(warm_entry_t));
+    if (!table)
+        return false;
+    w->capacity = capacity;
+    w->table = table;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (!old[i].uri[0])
+            continue;
+        size_t j = warmup_hash(old[i].uri) & (w->capacity - 1);
+        while (w->table[j].uri[0])
+            j = (j + 1) & (w->capacity - 1);
+        w->table[j] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+/** @brief Adds weight to a URI's score
+ *
+ *  @return false if the table couldn't grow to take a new URI
+ */
+static bool warmup_add(warmup_t *w, const char *uri, double weight) {
+    if (2 * (w->count + 1) > w->capacity && !warmup_grow(w))
+        return false;
+    size_t j = warmup_hash(uri) & (w->capacity - 1);
+    while (w->table[j].uri[0] && strcmp(w->table[j].uri, uri))
+        j = (j + 1) & (w->capacity - 1);
+    if (!w->table[j].uri[0]) {
+        strcpy(w->table[j].uri, uri);
+        w->count++;
+    }
+    w->table[j].score += weight;
+    return true;
+}
+
+/** @brief Parses "GET,uri,200,id" lines; anything else is skipped
+ *
+ *  @return true if line is a successful GET, with its URI copied to uri
+ */
+static bool warmup_parse(const char *line, char uri[64]) {
+    if (strncmp(line, "GET,", 4))
+        return false;
+    line += 4;
+    size_t len = strcspn(line, ",");
+    if (len < 1 || len > 63 || strncmp(line + len, ",200,", 5))
+        return false;
+    // Same grammar as conn_parse, so a log can't point us outside the directory
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char) line[i]) && line[i] != '.' && line[i] != '-')
+            return false;
+    }
+    memcpy(uri, line, len);
+    uri[len] = '\0';
+    return true;
+}
+
+/** @brief Orders entries hottest first
+ */
+static int warmup_cmp(const void *a, const void *b) {
+    double sa = ((const warm_entry_t *) a)->score, sb = ((const warm_entry_t *) b)->score;
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+/** @brief Background thread: rank the log's URIs, then prefetch within budget
+ */
+static void *warmup_thread(void *arg) {
+    warmup_t *w = arg;
+
+    // Count lines first so position in the log can be turned into a recency weight
+    char *line = NULL;
+    size_t linecap = 0;
+    size_t total = 0;
+    while (getline(&line, &linecap, w->log) > 0)
+        total++;
+    rewind(w->log);
+
+    char uri[64];
+    size_t lineno = 0;
+    while (getline(&line, &linecap, w->log) > 0) {
+        lineno++;
+        // Out of memory: warm up what was ranked so far
+        if (warmup_parse(line, uri) && !warmup_add(w, uri, 1.0 + (double) lineno / total))
+            break;
+    }
+    free(line);
+    fclose(w->log);
+
+    // Compact and rank
+    size_t n = 0;
+    for (size_t i = 0; i < w->capacity; i++) {
+        if (w->table[i].uri[0])
+            w->table[n++] = w->table[i];
+    }
+    if (n)
+        qsort(w->table, n, sizeof(warm_entry_t), warmup_cmp);
+
+    size_t used = 0;
+    for (size_t i = 0; i < n && used < w->budget; i++) {
+        int fd = layout_open(w->table[i].uri, O_RDONLY, 0);
+        if (fd < 0)
+            continue;
+        struct stat st;
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode) && used + st.st_size <= w->budget) {
+            posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+            readahead(fd, 0, st.st_size);
+            used += st.st_size;
+        }
+        close(fd);
+    }
+
+    free(w->table);
+    free(w);
+    return NULL;
+}
+
+/** @brief Starts the warm-up thread (see warmup.h)
+ *
+ *  @return 0 if the thread was started, -1 if the log can't be opened or out of memory
+ */
+int warmup_start(const char *audit_log, size_t budget) {
+    FILE *log = fopen(audit_log, "r");
+    if (!log)
+        return -1;
+    warmup_t *w = calloc(1, sizeof(warmup_t));
+    if (!w) {
+        fclose(log);
+        return -1;
+    }
+    w->log = log;
+    w->budget = budget;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, warmup_thread, w)) {
+        fclose(log);
+        free(w);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
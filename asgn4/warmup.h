@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+/** @brief Starts a background thread that pre-warms the page cache from a
+ *         previous run's audit log.
+ *
+ *         Successful GETs in the log (method,uri,status,request-id) are
+ *         counted per URI, with lines nearer the end of the log weighing
+ *         more, so recently hot objects win ties with stale ones. The URIs
+ *         are then prefetched hottest first with posix_fadvise(WILLNEED)
+ *         and readahead until budget bytes have been requested.
+ *
+ *         The server accepts connections while this runs.
+ *
+ *  @param audit_log path to an audit log written by a previous run
+ *
+ *  @param budget maximum number of bytes to prefetch
+ *
+ *  @return 0 if the thread was started, -1 if the log can't be opened or out of memory
+ */
+int warmup_start(const char *audit_log, size_t budget);
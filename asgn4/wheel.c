@@ -0,0 +1,133 @@
+#include "wheel.h"
+
+#include <pthread.h>
+#include <time.h>
+
+// 4 levels of 64 slots: level n covers delays up to 64^(n + 1) ticks
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN   ((uint64_t) 1 << (WHEEL_LEVELS * WHEEL_BITS))
+
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+// Circular lists with a sentinel head per slot
+static wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+// Next tick to process
+static uint64_t wheel_now;
+static unsigned wheel_tick_ms;
+
+/** @brief Monotonic milliseconds
+ */
+static uint64_t wheel_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** @brief Puts a timer in the slot for its expiry, relative to wheel_now. Must hold wheel_lock.
+ */
+static void wheel_place(wheel_timer_t *t) {
+    if (t->expires < wheel_now)
+        t->expires = wheel_now;
+    if (t->expires - wheel_now >= WHEEL_SPAN)
+        t->expires = wheel_now + WHEEL_SPAN - 1;
+
+    uint64_t delta = t->expires - wheel_now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << ((level + 1) * WHEEL_BITS))
+        level++;
+    wheel_timer_t *head = &slots[level][(t->expires >> (level * WHEEL_BITS)) & WHEEL_MASK];
+
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/** @brief Unlinks a timer from its slot. Must hold wheel_lock.
+ */
+static void wheel_unlink(wheel_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+/** @brief Moves every timer in one higher-level slot down to where it now belongs
+ *
+ *  @return the slot index, so the caller knows whether to cascade the next level too
+ */
+static unsigned wheel_cascade(int level) {
+    unsigned idx = (wheel_now >> (level * WHEEL_BITS)) & WHEEL_MASK;
+    wheel_timer_t *head = &slots[level][idx];
+    while (head->next != head) {
+        wheel_timer_t *t = head->next;
+        wheel_unlink(t);
+        wheel_place(t);
+    }
+    return idx;
+}
+
+/** @brief Processes every tick up to (but not including) target
+ */
+static void wheel_advance(uint64_t target) {
+    pthread_mutex_lock(&wheel_lock);
+    while (wheel_now < target) {
+        unsigned idx = wheel_now & WHEEL_MASK;
+        // Each time a level wraps, the next level's current slot comes due
+        for (int level = 1; idx == 0 && level < WHEEL_LEVELS; level++)
+            idx = wheel_cascade(level);
+
+        wheel_timer_t *head = &slots[0][wheel_now & WHEEL_MASK];
+        while (head->next != head) {
+            wheel_timer_t *t = head->next;
+            wheel_unlink(t);
+            t->fn(t);
+        }
+        wheel_now++;
+    }
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/** @brief Ticks the wheel forever
+ */
+static void *wheel_thread(void *arg) {
+    (void) arg;
+    uint64_t start = wheel_clock_ms();
+    struct timespec tick = { .tv_sec = wheel_tick_ms / 1000,
+        .tv_nsec = (wheel_tick_ms % 1000) * 1000000L };
+    while (1) {
+        nanosleep(&tick, NULL);
+        wheel_advance((wheel_clock_ms() - start) / wheel_tick_ms + 1);
+    }
+    return NULL;
+}
+
+void wheel_init(unsigned tick_ms) {
+    wheel_tick_ms = tick_ms ? tick_ms : 1;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int s = 0; s < WHEEL_SLOTS; s++)
+            slots[l][s].prev = slots[l][s].next = &slots[l][s];
+    }
+    pthread_t tid;
+    pthread_create(&tid, NULL, wheel_thread, NULL);
+    pthread_detach(tid);
+}
+
+void wheel_arm(wheel_timer_t *t, uint64_t ms, void (*fn)(wheel_timer_t *)) {
+    pthread_mutex_lock(&wheel_lock);
+    if (t->next)
+        wheel_unlink(t);
+    t->fn = fn;
+    // Round up, so a timer never fires early
+    t->expires = wheel_now + (ms + wheel_tick_ms - 1) / wheel_tick_ms;
+    wheel_place(t);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+void wheel_cancel(wheel_timer_t *t) {
+    pthread_mutex_lock(&wheel_lock);
+    if (t->next)
+        wheel_unlink(t);
+    pthread_mutex_unlock(&wheel_lock);
+}
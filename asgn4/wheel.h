@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** @struct wheel_timer_t
+ *
+ *  @brief A timer embedded in whatever it times out. Zero-initialize it
+ *         before first use.
+ */
+typedef struct wheel_timer {
+    struct wheel_timer *prev, *next;
+    // Tick at which it fires
+    uint64_t expires;
+    void (*fn)(struct wheel_timer *);
+} wheel_timer_t;
+
+/** @brief Starts the wheel's ticker thread
+ *
+ *  @param tick_ms timer resolution; timers fire up to one tick late
+ */
+void wheel_init(unsigned tick_ms);
+
+/** @brief Arms (or re-arms) a timer to call fn about ms from now. O(1).
+ *
+ *         fn runs on the ticker thread with the wheel locked, so it must be
+ *         quick and must not call back into the wheel. In return, once
+ *         wheel_cancel or wheel_arm returns, the old callback has either
+ *         finished or will never run.
+ */
+void wheel_arm(wheel_timer_t *t, uint64_t ms, void (*fn)(wheel_timer_t *));
+
+/** @brief Disarms a timer if it is armed. O(1).
+ */
+void wheel_cancel(wheel_timer_t *t);